@@ -0,0 +1,247 @@
+/* bench_write.c ; mcfg
+ * Measures the throughput of the mcfg writer against a plain fprintf loop
+ * and checks that the written file parses back to the same contents,
+ * including a file importing a fragment from its own directory.
+ *
+ * Usage: bench_write [sectors] [sections] [fields] [output]
+ */
+
+#include <mcfg.h>
+#include <mcfg_writer.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static mcfg_file *generate(int sectors, int sections, int fields) {
+  mcfg_file *file = calloc(1, sizeof(mcfg_file));
+  char name[64];
+  char value[128];
+
+  for (int i = 0; i < sectors; i++) {
+    snprintf(name, sizeof(name), "sector%d", i);
+    register_sector(file, name);
+    mcfg_sector *sector = &file->sectors[i];
+
+    for (int j = 0; j < sections; j++) {
+      snprintf(name, sizeof(name), "section%d", j);
+      register_section(sector, ST_FIELDS, name);
+      mcfg_section *section = &sector->sections[j];
+
+      for (int k = 0; k < fields; k++) {
+        snprintf(name, sizeof(name), "field%d", k);
+        snprintf(value, sizeof(value), "value of %d/%d/%d with $(field0)", i,
+                 j, k);
+        register_field(section, k % 8 == 0 ? FT_LIST : FT_STRING, name,
+                       value);
+      }
+    }
+
+    register_section(sector, ST_LINES, "script");
+    for (int j = 0; j < fields; j++) {
+      snprintf(value, sizeof(value), "echo line %d of sector %d", j, i);
+      parse_line(file, value);
+    }
+  }
+
+  return file;
+}
+
+static int write_fprintf(mcfg_file *file, char *path) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL)
+    return 1;
+
+  for (int i = 0; i < file->sector_count; i++) {
+    mcfg_sector *sector = &file->sectors[i];
+    fprintf(out, "%ssector %s\n", i > 0 ? "\n" : "", sector->name);
+
+    for (int j = 0; j < sector->section_count; j++) {
+      mcfg_section *section = &sector->sections[j];
+      if (section->type == ST_LINES) {
+        fprintf(out, "\n  lines %s:\n%s", section->name, section->lines);
+        continue;
+      }
+
+      fprintf(out, "\n  fields %s:\n", section->name);
+      for (int k = 0; k < section->field_count; k++)
+        fprintf(out, "    %s %s '%s'\n",
+                section->fields[k].type == FT_LIST ? "list" : "str",
+                section->fields[k].name, section->fields[k].value);
+    }
+  }
+
+  fclose(out);
+
+  return 0;
+}
+
+static int same_contents(mcfg_file *a, mcfg_file *b) {
+  if (a->sector_count != b->sector_count)
+    return 0;
+
+  for (int i = 0; i < a->sector_count; i++) {
+    mcfg_sector *sa = &a->sectors[i];
+    mcfg_sector *sb = &b->sectors[i];
+    if (strcmp(sa->name, sb->name) != 0 ||
+        sa->section_count != sb->section_count)
+      return 0;
+
+    for (int j = 0; j < sa->section_count; j++) {
+      mcfg_section *xa = &sa->sections[j];
+      mcfg_section *xb = &sb->sections[j];
+      if (strcmp(xa->name, xb->name) != 0 || xa->type != xb->type ||
+          xa->field_count != xb->field_count ||
+          xa->lines_len != xb->lines_len ||
+          (xa->lines != NULL && memcmp(xa->lines, xb->lines, xa->lines_len)))
+        return 0;
+
+      for (int k = 0; k < xa->field_count; k++)
+        if (xa->fields[k].type != xb->fields[k].type ||
+            strcmp(xa->fields[k].name, xb->fields[k].name) != 0 ||
+            strcmp(xa->fields[k].value, xb->fields[k].value) != 0)
+          return 0;
+    }
+  }
+
+  return 1;
+}
+
+static int write_text(char *path, char *text) {
+  FILE *out = fopen(path, "w");
+  if (out == NULL)
+    return 1;
+
+  fputs(text, out);
+  fclose(out);
+
+  return 0;
+}
+
+/* Writes a file importing a fragment next to it into a directory and checks
+ * that the import still refers to the fragment after saving and parsing the
+ * file again.
+ */
+static int round_trip_import(void) {
+  char *dir = "bench_write_import";
+  char *fragment = "bench_write_import/fragment.mcfg";
+  char *main_path = "bench_write_import/main.mcfg";
+  char *saved_path = "bench_write_import/saved.mcfg";
+
+  mkdir(dir, 0755);
+  int result = MCFG_ERR_UNKNOWN;
+  if (write_text(fragment, "sector shared\n  fields s:\n    str a '1'\n") ||
+      write_text(main_path, "import 'fragment.mcfg'\n\nsector main\n"
+                            "  fields s:\n    str b '$(a)'\n"))
+    goto cleanup;
+
+  mcfg_file *file = calloc(1, sizeof(mcfg_file));
+  mcfg_file *parsed = calloc(1, sizeof(mcfg_file));
+  file->path = main_path;
+  parsed->path = saved_path;
+
+  result = parse_file(file);
+  if (result == MCFG_OK)
+    result = save_mcfg_file(file, saved_path, 0);
+  if (result == MCFG_OK)
+    result = parse_file(parsed);
+
+  if (result == MCFG_OK &&
+      (!same_contents(file, parsed) || parsed->import_count != 1 ||
+       strcmp(parsed->import_paths[0], "fragment.mcfg") != 0 ||
+       find_field(parsed, "shared/s/a") == NULL))
+    result = MCFG_ERR_UNKNOWN;
+
+  free_mcfg_file(file);
+  free_mcfg_file(parsed);
+  free_mcfg_import_cache();
+
+cleanup:
+  unlink(saved_path);
+  unlink(main_path);
+  unlink(fragment);
+  rmdir(dir);
+
+  return result;
+}
+
+static double file_mb(char *path) {
+  struct stat st;
+  stat(path, &st);
+  return st.st_size / (1024.0 * 1024.0);
+}
+
+int main(int argc, char **argv) {
+  int sectors = argc > 1 ? atoi(argv[1]) : 100;
+  int sections = argc > 2 ? atoi(argv[2]) : 100;
+  int fields = argc > 3 ? atoi(argv[3]) : 100;
+  char *path = argc > 4 ? argv[4] : "bench_write.mcfg";
+
+  mcfg_file *file = generate(sectors, sections, fields);
+
+  double start = now();
+  if (write_fprintf(file, path) != 0) {
+    printf("Could not open %s\n", path);
+    return 1;
+  }
+  double fprintf_time = now() - start;
+  double size = file_mb(path);
+  printf("fprintf:  %8.1f MiB in %6.3fs, %8.1f MiB/s\n", size, fprintf_time,
+         size / fprintf_time);
+
+  int result = MCFG_OK;
+  for (int canonical = 0; canonical < 2 && result == MCFG_OK; canonical++) {
+    start = now();
+    result = save_mcfg_file(file, path, canonical ? MCFG_WRITE_CANONICAL : 0);
+    double write_time = now() - start;
+    if (result != MCFG_OK) {
+      printf("Writing failed: 0x%.8x\n", result);
+      break;
+    }
+
+    size = file_mb(path);
+    printf("%s %8.1f MiB in %6.3fs, %8.1f MiB/s\n",
+           canonical ? "canonical:" : "writer:   ", size, write_time,
+           size / write_time);
+  }
+
+  if (result == MCFG_OK) {
+    // The generated names sort differently than they were generated, so only
+    // the order preserving output is compared
+    result = save_mcfg_file(file, path, 0);
+
+    mcfg_file *parsed = calloc(1, sizeof(mcfg_file));
+    parsed->path = path;
+    if (result == MCFG_OK)
+      result = parse_file(parsed);
+
+    if (result != MCFG_OK)
+      printf("Round trip failed: 0x%.8x\n", result);
+    else if (!same_contents(file, parsed))
+      result = MCFG_ERR_UNKNOWN;
+
+    printf("round trip: %s\n", result == MCFG_OK ? "ok" : "FAILED");
+    free_mcfg_file(parsed);
+  }
+
+  if (result == MCFG_OK) {
+    result = round_trip_import();
+    printf("round trip with import: %s\n",
+           result == MCFG_OK ? "ok" : "FAILED");
+  }
+
+  free_mcfg_file(file);
+  unlink(path);
+
+  return result;
+}
@@ -0,0 +1,63 @@
+/*
+ * gen_ident.c ; author: Marie Eckert
+ *
+ * C identifiers for the code generators mcfg_gen and mcfg2c.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#include "gen_ident.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+/******** file private ********/
+
+static const char *keywords[] = {
+    "auto",     "break",    "case",     "char",   "const",    "continue",
+    "default",  "do",       "double",   "else",   "enum",     "extern",
+    "float",    "for",      "goto",     "if",     "inline",   "int",
+    "long",     "register", "restrict", "return", "short",    "signed",
+    "sizeof",   "static",   "struct",   "switch", "typedef",  "union",
+    "unsigned", "void",     "volatile", "while",  "_Bool",    "_Complex",
+    "_Imaginary"};
+
+/******** gen_ident.h ********/
+
+char *to_ident(char *name) {
+  while (*name != 0 && !isalnum((unsigned char)*name))
+    name++;
+
+  char *ident = malloc(strlen(name) + 2);
+  int offs = 0;
+  if (isdigit((unsigned char)*name))
+    ident[offs++] = '_';
+
+  for (; *name != 0; name++)
+    ident[offs++] = isalnum((unsigned char)*name) ? *name : '_';
+
+  ident[offs] = 0;
+  return ident;
+}
+
+int invalid_ident(char *ident) {
+  if (*ident == 0)
+    return 1;
+
+  for (size_t i = 0; i < sizeof(keywords) / sizeof(keywords[0]); i++)
+    if (strcmp(ident, keywords[i]) == 0)
+      return 1;
+
+  return 0;
+}
+
+int is_c_name(char *name) {
+  char *ident = to_ident(name);
+  int valid = strcmp(ident, name) == 0 && !invalid_ident(ident);
+  free(ident);
+
+  return valid;
+}
@@ -0,0 +1,26 @@
+/*
+ * gen_ident.h ; author: Marie Eckert
+ *
+ * C identifiers for the code generators mcfg_gen and mcfg2c.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#ifndef GEN_IDENT_H
+#define GEN_IDENT_H
+
+/* Turns a mcfg name into a C identifier by dropping leading characters which
+ * are not letters or digits and replacing all others by '_'. A leading digit
+ * is prefixed with '_'. The result has to be freed.
+ */
+char *to_ident(char *name);
+
+/* Returns non-zero if the identifier is empty or a C keyword. */
+int invalid_ident(char *ident);
+
+/* Returns non-zero if the name can be used as is as a C identifier. */
+int is_c_name(char *name);
+
+#endif
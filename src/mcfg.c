@@ -17,389 +17,2454 @@
 #include <mcfg.h>
 
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#ifdef MCFG_ZSTD
+#include <zstd.h>
+#endif
 
 #include <butter/strutils.h>
 
-/******** file private ********/
+/******** file private ********/
+
+static void *libc_malloc(void *ctx, size_t size) { return malloc(size); }
+
+static void *libc_realloc(void *ctx, void *ptr, size_t size) {
+  return realloc(ptr, size);
+}
+
+static void libc_free(void *ctx, void *ptr) { free(ptr); }
+
+static mcfg_allocator libc_allocator = {libc_malloc, libc_realloc, libc_free,
+                                        NULL};
+
+static mcfg_allocator *global_allocator = &libc_allocator;
+
+/* Storage; The string pool of a mcfg_storage is handed out by a bump
+ * allocator. Only the most recent allocation can be grown, which is enough
+ * for the lines buffer of the current section. Records are taken from the
+ * fixed arrays by the registering functions directly.
+ */
+
+static void *storage_malloc(void *ctx, size_t size) {
+  mcfg_storage *storage = ctx;
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if (size > MCFG_STRING_POOL_SIZE - storage->string_offs)
+    return NULL;
+
+  storage->last_offs = storage->string_offs;
+  storage->string_offs += size;
+
+  return storage->strings + storage->last_offs;
+}
+
+static void *storage_realloc(void *ctx, void *ptr, size_t size) {
+  mcfg_storage *storage = ctx;
+  if (ptr == NULL)
+    return storage_malloc(ctx, size);
+
+  if (ptr != storage->strings + storage->last_offs)
+    return NULL;
+
+  size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+  if (size > MCFG_STRING_POOL_SIZE - storage->last_offs)
+    return NULL;
+
+  storage->string_offs = storage->last_offs + size;
+
+  return ptr;
+}
+
+static void storage_free(void *ctx, void *ptr) {}
+
+static mcfg_storage *allocator_storage(mcfg_allocator *allocator) {
+  if (allocator == NULL || allocator->malloc != storage_malloc)
+    return NULL;
+
+  return allocator->ctx;
+}
+
+/* Error for a failed allocation, running out of storage is not reported as
+ * ENOMEM.
+ */
+static int alloc_error(mcfg_allocator *allocator) {
+  return allocator_storage(allocator) != NULL ? MCFG_ERR_CAPACITY
+                                              : MCFG_ERR_MASK_ERRNO | ENOMEM;
+}
+
+/* Lookup tracing; Without hooks a lookup only pays for loading the hook
+ * pointer. With hooks, only every sample_rate-th lookup of a thread is timed
+ * and reported.
+ */
+
+static mcfg_trace_hooks *trace_hooks = NULL;
+static _Thread_local unsigned trace_tick = 0;
+static _Thread_local int resolve_depth = 0;
+static _Thread_local int resolve_max_depth = 0;
+
+typedef struct trace_span {
+  mcfg_trace_hooks *hooks;
+  struct timespec start;
+} trace_span;
+
+static int trace_begin(trace_span *span) {
+  span->hooks = __atomic_load_n(&trace_hooks, __ATOMIC_ACQUIRE);
+  if (span->hooks == NULL)
+    return 0;
+
+  if (span->hooks->sample_rate > 1 &&
+      ++trace_tick % span->hooks->sample_rate != 0) {
+    span->hooks = NULL;
+    return 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &span->start);
+  return 1;
+}
+
+static void trace_end(trace_span *span, mcfg_trace_kind kind, char *path,
+                      int depth) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  unsigned long ns = (end.tv_sec - span->start.tv_sec) * 1000000000UL +
+                     end.tv_nsec - span->start.tv_nsec;
+  span->hooks->on_lookup(span->hooks->user, kind, path, ns, depth);
+}
+
+/* Content hashes; XXH64 of the names and values. The hash of a section,
+ * sector or file combines the hashes of its children independent of their
+ * order, since the order of fields, sections and sectors has no meaning.
+ */
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+  acc += input * PRIME64_2;
+  acc = rotl64(acc, 31);
+  return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh64_round(0, val);
+  return acc * PRIME64_1 + PRIME64_4;
+}
+
+static uint64_t xxh64_avalanche(uint64_t h) {
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+static uint64_t xxh64(const void *data, size_t len, uint64_t seed) {
+  const unsigned char *p = data;
+  const unsigned char *end = p + len;
+  uint64_t h;
+
+  if (len >= 32) {
+    uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+    uint64_t v2 = seed + PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - PRIME64_1;
+
+    do {
+      v1 = xxh64_round(v1, read64(p));
+      v2 = xxh64_round(v2, read64(p + 8));
+      v3 = xxh64_round(v3, read64(p + 16));
+      v4 = xxh64_round(v4, read64(p + 24));
+      p += 32;
+    } while (p + 32 <= end);
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh64_merge(h, v1);
+    h = xxh64_merge(h, v2);
+    h = xxh64_merge(h, v3);
+    h = xxh64_merge(h, v4);
+  } else {
+    h = seed + PRIME64_5;
+  }
+
+  h += len;
+
+  for (; p + 8 <= end; p += 8) {
+    h ^= xxh64_round(0, read64(p));
+    h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+  }
+
+  if (p + 4 <= end) {
+    h ^= (uint64_t)read32(p) * PRIME64_1;
+    h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+    p += 4;
+  }
+
+  for (; p < end; p++) {
+    h ^= (*p) * PRIME64_5;
+    h = rotl64(h, 11) * PRIME64_1;
+  }
+
+  return xxh64_avalanche(h);
+}
+
+/* Hash of a name, seeded with the kind of the record it names */
+static uint64_t hash_name(char *name, uint64_t seed) {
+  return name == NULL ? seed : xxh64(name, strlen(name), seed);
+}
+
+static uint64_t hash_field(mcfg_field *field) {
+  uint64_t hash = hash_name(field->name, field->type);
+  return hash_name(field->value, hash);
+}
+
+/* Combines the hash of a record with the sum of the hashes of its children */
+static uint64_t combine_hashes(uint64_t own, uint64_t children) {
+  return xxh64_avalanche(own ^ (children * PRIME64_2));
+}
+
+/* Generations are drawn from a process wide counter, so a handle never
+ * validates against a file it was not taken from, even if the struct is
+ * reused.
+ */
+static unsigned long generation_counter = 0;
+
+static unsigned long next_generation(void) {
+  return __atomic_add_fetch(&generation_counter, 1, __ATOMIC_RELAXED);
+}
+
+static mcfg_allocator *file_allocator(struct mcfg_file *file) {
+  if (file->allocator == NULL)
+    file->allocator = global_allocator;
+
+  return file->allocator;
+}
+
+static char *strndup_span(mcfg_allocator *allocator, char *str, int len) {
+  char *result = mcfg_malloc(allocator, len + 1);
+  if (result == NULL)
+    return NULL;
+
+  memcpy(result, str, len);
+  result[len] = 0;
+
+  return result;
+}
+
+static mcfg_stype strtostype(char *str, int len) {
+  if (len == 6 && strncmp(str, "fields", len) == 0)
+    return ST_FIELDS;
+
+  if (len == 5 && strncmp(str, "lines", len) == 0)
+    return ST_LINES;
+
+  return ST_UNKNOWN;
+}
+
+static mcfg_ftype strtoftype(char *str, int len) {
+  if (len == 3 && strncmp(str, "str", len) == 0)
+    return FT_STRING;
+
+  if (len == 4 && strncmp(str, "list", len) == 0)
+    return FT_LIST;
+
+  return FT_UNKNOWN;
+}
+
+/* Line lexer; Every line is classified in a single pass over its characters
+ * and split into spans pointing into the line, nothing is copied.
+ */
+
+#define CC_WORD 0
+#define CC_SPACE 1
+#define CC_COMMENT 2
+#define CC_QUOTE 3
+#define CC_COLON 4
+#define CC_END 5
+
+static const unsigned char char_classes[256] = {
+    [0] = CC_END,          ['\t'] = CC_SPACE,    ['\n'] = CC_SPACE,
+    ['\v'] = CC_SPACE,     ['\f'] = CC_SPACE,    ['\r'] = CC_SPACE,
+    [' '] = CC_SPACE,      [';'] = CC_COMMENT,   ['\''] = CC_QUOTE,
+    ['"'] = CC_QUOTE,      [':'] = CC_COLON,
+};
+
+typedef enum line_kind {
+  LK_EMPTY,
+  LK_SECTOR,
+  LK_SECTION,
+  LK_IMPORT,
+  LK_FIELD,
+  LK_LINE
+} line_kind;
+
+typedef struct line_keyword {
+  char *word;
+  int len;
+  line_kind kind;
+} line_keyword;
+
+static const line_keyword keywords[] = {
+    {"sector", 6, LK_SECTOR}, {"fields", 6, LK_SECTION},
+    {"lines", 5, LK_SECTION}, {"import", 6, LK_IMPORT},
+    {"include", 7, LK_IMPORT},
+};
+
+typedef struct line_token {
+  line_kind kind;
+  char *keyword;
+  int keyword_len;
+  char *name;
+  int name_len;
+  char *value;
+  int value_len;
+  int column;
+} line_token;
+
+static int skip_class(char *line, int i, int len, int class) {
+  while (i < len && char_classes[(unsigned char)line[i]] == class)
+    i++;
+
+  return i;
+}
+
+static int skip_word(char *line, int i, int len) {
+  while (i < len && char_classes[(unsigned char)line[i]] != CC_SPACE)
+    i++;
+
+  return i;
+}
+
+/* Lexes the given line into token. Within lines sections only sector and
+ * section headers are recognised, every other line is returned as a whole
+ * with leading and trailing whitespace removed.
+ *
+ * token->column is set to the 1-based column of the name of the token or of
+ * the error if lexing failed.
+ */
+static int lex_line(char *line, int len, int in_lines, line_token *token) {
+  // Strip trailing whitespace
+  while (len > 0 && char_classes[(unsigned char)line[len - 1]] == CC_SPACE)
+    len--;
+
+  int i = skip_class(line, 0, len, CC_SPACE);
+  memset(token, 0, sizeof(line_token));
+  token->kind = LK_EMPTY;
+  token->column = i + 1;
+
+  if (i == len || char_classes[(unsigned char)line[i]] == CC_COMMENT)
+    return MCFG_OK;
+
+  token->keyword = line + i;
+  i = skip_word(line, i, len);
+  token->keyword_len = line + i - token->keyword;
+
+  token->kind = in_lines ? LK_LINE : LK_FIELD;
+  for (int k = 0; k < sizeof(keywords) / sizeof(keywords[0]); k++) {
+    if (keywords[k].len == token->keyword_len &&
+        memcmp(keywords[k].word, token->keyword, token->keyword_len) == 0) {
+      token->kind = keywords[k].kind;
+      break;
+    }
+  }
+
+  // Import directives are plain content within lines sections
+  if (token->kind == LK_IMPORT && in_lines)
+    token->kind = LK_LINE;
+
+  if (token->kind == LK_LINE) {
+    token->value = token->keyword;
+    token->value_len = line + len - token->value;
+    return MCFG_OK;
+  }
+
+  i = skip_class(line, i, len, CC_SPACE);
+  token->column = i + 1;
+  if (i == len)
+    return MCFG_PERR_INVALID_SYNTAX;
+
+  if (token->kind == LK_IMPORT) {
+    token->value = line + i;
+    token->value_len = len - i;
+    goto lex_line_unquote;
+  }
+
+  token->name = line + i;
+  i = skip_word(line, i, len);
+  token->name_len = line + i - token->name;
+
+  if (token->kind == LK_SECTION) {
+    if (char_classes[(unsigned char)token->name[token->name_len - 1]] !=
+        CC_COLON) {
+      token->column = i;
+      return MCFG_PERR_INVALID_SYNTAX;
+    }
+
+    token->name_len--;
+  }
+
+  if (token->kind == LK_SECTOR || token->kind == LK_SECTION) {
+    i = skip_class(line, i, len, CC_SPACE);
+    if (i < len && char_classes[(unsigned char)line[i]] != CC_COMMENT) {
+      token->column = i + 1;
+      return MCFG_PERR_INVALID_SYNTAX;
+    }
+
+    if (token->name_len == 0)
+      return MCFG_PERR_INVALID_IDENTIFIER;
+
+    return MCFG_OK;
+  }
+
+  i = skip_class(line, i, len, CC_SPACE);
+  if (i == len) {
+    token->column = i + 1;
+    return MCFG_PERR_INVALID_SYNTAX;
+  }
+
+  token->value = line + i;
+  token->value_len = len - i;
+
+lex_line_unquote:
+  if (char_classes[(unsigned char)token->value[0]] == CC_QUOTE) {
+    if (token->value_len < 2 ||
+        token->value[token->value_len - 1] != token->value[0]) {
+      token->column = len;
+      return MCFG_PERR_INVALID_SYNTAX;
+    }
+
+    token->value++;
+    token->value_len -= 2;
+  } else if (token->kind == LK_FIELD) {
+    token->column = token->value - line + 1;
+    return MCFG_PERR_INVALID_SYNTAX;
+  }
+
+  return MCFG_OK;
+}
+
+static mcfg_section *current_section(struct mcfg_file *file) {
+  if (file->sector_count == 0)
+    return NULL;
+
+  mcfg_sector *sector = &file->sectors[file->sector_count - 1];
+  if (sector->section_count == 0)
+    return NULL;
+
+  return &sector->sections[sector->section_count - 1];
+}
+
+/* Import cache; Fragments are identified by their inode and mtime so that
+ * the same file reached through different paths is only parsed once and a
+ * modified file is parsed again.
+ */
+
+#define IMPORT_PARSING 0
+#define IMPORT_DONE 1
+
+typedef struct import_entry {
+  mcfg_allocator *allocator;
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  int state;
+  mcfg_file *file;
+  struct import_entry *next;
+} import_entry;
+
+static import_entry *import_cache = NULL;
+
+/* The cache is shared by all threads. The lock is held while a fragment is
+ * parsed, so it has to be recursive for nested imports.
+ */
+static pthread_mutex_t import_lock;
+static pthread_once_t import_lock_once = PTHREAD_ONCE_INIT;
+
+static void init_import_lock(void) {
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&import_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+
+static void lock_import_cache(void) {
+  pthread_once(&import_lock_once, init_import_lock);
+  pthread_mutex_lock(&import_lock);
+}
+
+/* NOTE: The returned string of this function has to be freed after usage!!!
+ */
+static char *resolve_import_path(mcfg_allocator *allocator, char *importer,
+                                 char *path, int len) {
+  char *sep = importer == NULL ? NULL : strrchr(importer, '/');
+  if (path[0] == '/' || sep == NULL)
+    return strndup_span(allocator, path, len);
+
+  int dir_len = sep - importer + 1;
+  char *result = mcfg_malloc(allocator, dir_len + len + 1);
+  if (result == NULL)
+    return NULL;
+
+  memcpy(result, importer, dir_len);
+  memcpy(result + dir_len, path, len);
+  result[dir_len + len] = 0;
+
+  return result;
+}
+
+/* Imports the fragment into the file, the caller holds the cache lock and
+ * releases it on every return.
+ */
+static int import_file_locked(struct mcfg_file *file, char *path, int len) {
+  // Fragments are shared by all importers, so they belong to the global
+  // allocator instead of the importing file's.
+  mcfg_allocator *allocator = global_allocator;
+  char *full_path = resolve_import_path(allocator, file->path, path, len);
+  if (full_path == NULL)
+    return alloc_error(allocator);
+
+  struct stat st;
+  errno = 0;
+  if (stat(full_path, &st) != 0) {
+    mcfg_free(allocator, full_path);
+    return MCFG_ERR_MASK_ERRNO | errno;
+  }
+
+  import_entry *entry = import_cache;
+  while (entry != NULL) {
+    if (entry->dev == st.st_dev && entry->ino == st.st_ino &&
+        entry->mtime.tv_sec == st.st_mtim.tv_sec &&
+        entry->mtime.tv_nsec == st.st_mtim.tv_nsec)
+      break;
+    entry = entry->next;
+  }
+
+  if (entry != NULL && entry->state == IMPORT_PARSING) {
+    mcfg_free(allocator, full_path);
+    return MCFG_PERR_IMPORT_CYCLE;
+  }
+
+  if (entry == NULL) {
+    entry = mcfg_malloc(allocator, sizeof(import_entry));
+    mcfg_file *fragment = mcfg_malloc(allocator, sizeof(mcfg_file));
+    if (entry == NULL || fragment == NULL) {
+      mcfg_free(allocator, entry);
+      mcfg_free(allocator, fragment);
+      mcfg_free(allocator, full_path);
+      return alloc_error(allocator);
+    }
+
+    entry->allocator = allocator;
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->mtime = st.st_mtim;
+    entry->state = IMPORT_PARSING;
+    entry->file = fragment;
+    entry->file->path = full_path;
+    entry->next = import_cache;
+    import_cache = entry;
+
+    int ret = parse_file_with_allocator(entry->file, allocator);
+    if (ret != MCFG_OK) {
+      // Leave the entry in the cache so it gets freed with the cache, but make
+      // sure that it is never matched again.
+      entry->ino = 0;
+      entry->state = IMPORT_DONE;
+      return ret;
+    }
+
+    entry->state = IMPORT_DONE;
+  } else {
+    mcfg_free(allocator, full_path);
+  }
+
+  for (int i = 0; i < file->import_count; i++)
+    if (file->imports[i] == entry->file)
+      return MCFG_OK;
+
+  // The file is left unchanged if any of the allocations fails
+  mcfg_allocator *file_alloc = file_allocator(file);
+  int count = file->import_count + 1;
+  char *import_path = strndup_span(file_alloc, path, len);
+  if (import_path == NULL)
+    return alloc_error(file_alloc);
+
+  mcfg_file **imports =
+      mcfg_realloc(file_alloc, file->imports, count * sizeof(mcfg_file *));
+  if (imports == NULL) {
+    mcfg_free(file_alloc, import_path);
+    return alloc_error(file_alloc);
+  }
+  file->imports = imports;
+
+  char **import_paths =
+      mcfg_realloc(file_alloc, file->import_paths, count * sizeof(char *));
+  if (import_paths == NULL) {
+    mcfg_free(file_alloc, import_path);
+    return alloc_error(file_alloc);
+  }
+  file->import_paths = import_paths;
+
+  file->imports[count - 1] = entry->file;
+  file->import_paths[count - 1] = import_path;
+  file->import_count = count;
+
+  return MCFG_OK;
+}
+
+static void free_section_contents(mcfg_allocator *allocator,
+                                  mcfg_section *section) {
+  for (int i = 0; i < section->field_count; i++) {
+    mcfg_free(allocator, section->fields[i].name);
+    mcfg_free(allocator, section->fields[i].value);
+  }
+
+  mcfg_free(allocator, section->fields);
+  mcfg_free(allocator, section->name);
+  mcfg_free(allocator, section->lines);
+}
+
+static void free_file_contents(mcfg_file *file) {
+  mcfg_allocator *allocator = file_allocator(file);
+
+  for (int i = 0; i < file->sector_count; i++) {
+    mcfg_sector *sector = &file->sectors[i];
+    for (int j = 0; j < sector->section_count; j++)
+      free_section_contents(allocator, &sector->sections[j]);
+
+    mcfg_free(allocator, sector->sections);
+    mcfg_free(allocator, sector->name);
+  }
+
+  mcfg_free(allocator, file->sectors);
+  mcfg_free(allocator, file->imports);
+
+  if (file->import_paths != NULL)
+    for (int i = 0; i < file->import_count; i++)
+      mcfg_free(allocator, file->import_paths[i]);
+  mcfg_free(allocator, file->import_paths);
+}
+
+static int import_file(struct mcfg_file *file, char *path, int len) {
+  lock_import_cache();
+  int ret = import_file_locked(file, path, len);
+  pthread_mutex_unlock(&import_lock);
+
+  return ret;
+}
+
+/******** mcfg.h ********/
+
+void set_mcfg_allocator(mcfg_allocator *allocator) {
+  global_allocator = allocator == NULL ? &libc_allocator : allocator;
+}
+
+mcfg_allocator *get_mcfg_allocator(void) { return global_allocator; }
+
+void *mcfg_malloc(mcfg_allocator *allocator, size_t size) {
+  if (allocator == NULL)
+    allocator = global_allocator;
+
+  return allocator->malloc(allocator->ctx, size);
+}
+
+void *mcfg_realloc(mcfg_allocator *allocator, void *ptr, size_t size) {
+  if (allocator == NULL)
+    allocator = global_allocator;
+
+  if (ptr == NULL)
+    return allocator->malloc(allocator->ctx, size);
+
+  return allocator->realloc(allocator->ctx, ptr, size);
+}
+
+void mcfg_free(mcfg_allocator *allocator, void *ptr) {
+  if (ptr == NULL)
+    return;
+
+  if (allocator == NULL)
+    allocator = global_allocator;
+
+  allocator->free(allocator->ctx, ptr);
+}
+
+void free_mcfg_file(mcfg_file *file) {
+  free_file_contents(file);
+  free(file);
+}
+
+void free_mcfg_import_cache(void) {
+  lock_import_cache();
+  while (import_cache != NULL) {
+    import_entry *next = import_cache->next;
+    mcfg_allocator *allocator = import_cache->allocator;
+
+    mcfg_free(allocator, import_cache->file->path);
+    free_file_contents(import_cache->file);
+    mcfg_free(allocator, import_cache->file);
+    mcfg_free(allocator, import_cache);
+    import_cache = next;
+  }
+  pthread_mutex_unlock(&import_lock);
+}
+
+static int split_path(char *path, char **elems, int *lens, int n);
+
+static void update_section_hash(mcfg_section *section) {
+  uint64_t children = 0;
+  for (int i = 0; i < section->field_count; i++)
+    children += section->fields[i].hash;
+
+  // The lines are text, so their order matters
+  if (section->lines != NULL)
+    children += xxh64(section->lines, section->lines_len, PRIME64_3);
+
+  section->hash =
+      combine_hashes(hash_name(section->name, section->type), children);
+}
+
+/* Only combines the hashes of the sections, which have to be up to date */
+static void update_sector_hash(mcfg_sector *sector) {
+  uint64_t children = 0;
+  for (int i = 0; i < sector->section_count; i++)
+    children += sector->sections[i].hash;
+
+  sector->hash = combine_hashes(hash_name(sector->name, PRIME64_4), children);
+}
+
+static void update_file_hash(mcfg_file *file) {
+  uint64_t children = 0;
+  for (int i = 0; i < file->sector_count; i++)
+    children += file->sectors[i].hash;
+
+  // Imports take part since lookups fall back to them
+  uint64_t imports = 0;
+  for (int i = 0; i < file->import_count; i++)
+    imports = xxh64_merge(imports, file->imports[i]->hash);
+
+  file->hash = combine_hashes(imports, children);
+}
+
+void update_mcfg_hashes(mcfg_file *file) {
+  for (int i = 0; i < file->sector_count; i++) {
+    mcfg_sector *sector = &file->sectors[i];
+    for (int j = 0; j < sector->section_count; j++)
+      update_section_hash(&sector->sections[j]);
+
+    update_sector_hash(sector);
+  }
+
+  update_file_hash(file);
+}
+
+int get_mcfg_hash(mcfg_file *file, char *path, uint64_t *hash) {
+  char *elems[4];
+  int lens[4];
+  int depth = path == NULL || path[0] == 0
+                  ? 0
+                  : split_path(path, elems, lens, 4);
+
+  switch (depth) {
+  case 0:
+    *hash = file->hash;
+    return MCFG_OK;
+  case 1: {
+    mcfg_sector *sector = find_sector(file, path);
+    if (sector == NULL)
+      return MCFG_ERR_UNKNOWN;
+
+    *hash = sector->hash;
+    return MCFG_OK;
+  }
+  case 2: {
+    mcfg_section *section = find_section(file, path);
+    if (section == NULL)
+      return MCFG_ERR_UNKNOWN;
+
+    *hash = section->hash;
+    return MCFG_OK;
+  }
+  case 3: {
+    mcfg_field *field = find_field(file, path);
+    if (field == NULL)
+      return MCFG_ERR_UNKNOWN;
+
+    *hash = field->hash;
+    return MCFG_OK;
+  }
+  default:
+    return MCFG_ERR_UNKNOWN;
+  }
+}
+
+void set_mcfg_trace_hooks(mcfg_trace_hooks *hooks) {
+  __atomic_store_n(&trace_hooks, hooks, __ATOMIC_RELEASE);
+}
+
+/* Parsing Functions */
+
+static int register_sector_n(struct mcfg_file *file, char *name, int len) {
+  // Check for duplicate sectors
+  for (int i = 0; i < file->sector_count; i++)
+    if (strncmp(file->sectors[i].name, name, len) == 0 &&
+        file->sectors[i].name[len] == 0)
+      return MCFG_PERR_DUPLICATE_SECTOR;
+
+  mcfg_allocator *allocator = file_allocator(file);
+  mcfg_storage *storage = allocator_storage(allocator);
+  int wi = file->sector_count;
+
+  if (storage != NULL && storage->sector_count == MCFG_MAX_SECTORS)
+    return MCFG_ERR_CAPACITY;
+
+  char *dup = strndup_span(allocator, name, len);
+  if (dup == NULL)
+    return alloc_error(allocator);
+
+  file->sector_count++;
+  if (storage != NULL) {
+    file->sectors = storage->sectors;
+    storage->sector_count++;
+  } else if (wi == 0) {
+    file->sectors = mcfg_malloc(allocator, sizeof(mcfg_sector));
+  } else {
+    file->sectors = mcfg_realloc(allocator, file->sectors,
+                                 (wi + 1) * sizeof(mcfg_sector));
+  }
+
+  file->sectors[wi].section_count = 0;
+  file->sectors[wi].sections = NULL;
+  file->sectors[wi].allocator = allocator;
+  file->sectors[wi].name = dup;
+
+  return MCFG_OK;
+}
+
+static int register_section_n(struct mcfg_sector *sector, mcfg_stype type,
+                              char *name, int len) {
+  // Check for duplicate sections
+  for (int i = 0; i < sector->section_count; i++)
+    if (strncmp(sector->sections[i].name, name, len) == 0 &&
+        sector->sections[i].name[len] == 0)
+      return MCFG_PERR_DUPLICATE_SECTION;
+
+  if (sector->allocator == NULL)
+    sector->allocator = global_allocator;
+
+  mcfg_allocator *allocator = sector->allocator;
+  mcfg_storage *storage = allocator_storage(allocator);
+  int wi = sector->section_count;
+
+  // The sections of a sector have to stay contiguous within the storage, so
+  // only the last sector can grow.
+  if (storage != NULL &&
+      (storage->section_count == MCFG_MAX_SECTIONS ||
+       (wi > 0 &&
+        sector->sections + wi != storage->sections + storage->section_count)))
+    return MCFG_ERR_CAPACITY;
+
+  char *dup = strndup_span(allocator, name, len);
+  if (dup == NULL)
+    return alloc_error(allocator);
+
+  sector->section_count++;
+  if (storage != NULL) {
+    if (wi == 0)
+      sector->sections = storage->sections + storage->section_count;
+    storage->section_count++;
+  } else if (wi == 0) {
+    sector->sections = mcfg_malloc(allocator, sizeof(mcfg_section));
+  } else {
+    sector->sections = mcfg_realloc(allocator, sector->sections,
+                                    (wi + 1) * sizeof(mcfg_section));
+  }
+
+  sector->sections[wi].allocator = allocator;
+  sector->sections[wi].field_count = 0;
+  sector->sections[wi].fields = NULL;
+  sector->sections[wi].lines = NULL;
+  sector->sections[wi].lines_len = 0;
+  sector->sections[wi].name = dup;
+  sector->sections[wi].type = type;
+
+  return MCFG_OK;
+}
+
+static int register_field_n(struct mcfg_section *section, mcfg_ftype type,
+                            char *name, int name_len, char *value,
+                            int value_len) {
+  // Check for duplicate fields
+  for (int i = 0; i < section->field_count; i++)
+    if (strncmp(section->fields[i].name, name, name_len) == 0 &&
+        section->fields[i].name[name_len] == 0)
+      return MCFG_PERR_DUPLICATE_FIELD;
+
+  if (section->allocator == NULL)
+    section->allocator = global_allocator;
+
+  mcfg_allocator *allocator = section->allocator;
+  mcfg_storage *storage = allocator_storage(allocator);
+  int wi = section->field_count;
+
+  if (storage != NULL &&
+      (storage->field_count == MCFG_MAX_FIELDS ||
+       (wi > 0 &&
+        section->fields + wi != storage->fields + storage->field_count)))
+    return MCFG_ERR_CAPACITY;
+
+  char *name_dup = strndup_span(allocator, name, name_len);
+  char *value_dup = strndup_span(allocator, value, value_len);
+  if (name_dup == NULL || value_dup == NULL) {
+    mcfg_free(allocator, name_dup);
+    mcfg_free(allocator, value_dup);
+    return alloc_error(allocator);
+  }
+
+  section->field_count++;
+  if (storage != NULL) {
+    if (wi == 0)
+      section->fields = storage->fields + storage->field_count;
+    storage->field_count++;
+  } else if (wi == 0) {
+    section->fields = mcfg_malloc(allocator, sizeof(mcfg_field));
+  } else {
+    section->fields = mcfg_realloc(allocator, section->fields,
+                                   (wi + 1) * sizeof(mcfg_field));
+  }
+
+  section->fields[wi].type = type;
+  section->fields[wi].name = name_dup;
+  section->fields[wi].value = value_dup;
+  section->fields[wi].hash = hash_field(&section->fields[wi]);
+
+  return MCFG_OK;
+}
+
+/* The lines buffer grows in powers of two, so its capacity can be derived
+ * from its length.
+ */
+static size_t lines_capacity(size_t len) {
+  size_t capacity = 64;
+  while (capacity < len + 1)
+    capacity *= 2;
+
+  return capacity;
+}
+
+static int append_line(struct mcfg_section *section, char *line, int len) {
+  size_t new_len = section->lines_len + len + 1;
+
+  if (allocator_storage(section->allocator) != NULL) {
+    // The lines buffer is the most recent allocation of the storage, so it
+    // can be grown in place to its exact size.
+    char *lines = mcfg_realloc(section->allocator, section->lines, new_len + 1);
+    if (lines == NULL)
+      return MCFG_ERR_CAPACITY;
+
+    section->lines = lines;
+  } else if (section->lines == NULL) {
+    section->lines = mcfg_malloc(section->allocator, lines_capacity(new_len));
+  } else if (lines_capacity(section->lines_len) < new_len + 1) {
+    section->lines = mcfg_realloc(section->allocator, section->lines,
+                                  lines_capacity(new_len));
+  }
+
+  memcpy(section->lines + section->lines_len, line, len);
+  section->lines[new_len - 1] = '\n';
+  section->lines[new_len] = 0;
+  section->lines_len = new_len;
+
+  return MCFG_OK;
+}
+
+int register_sector(struct mcfg_file *file, char *name) {
+  if (name == NULL)
+    return MCFG_ERR_UNKNOWN;
+
+  return register_sector_n(file, name, strlen(name));
+}
+
+int register_section(struct mcfg_sector *sector, mcfg_stype type, char *name) {
+  if (name == NULL)
+    return MCFG_ERR_UNKNOWN;
+
+  return register_section_n(sector, type, name, strlen(name));
+}
+
+int register_field(struct mcfg_section *section, mcfg_ftype type, char *name,
+                   char *value) {
+  if (name == NULL || value == NULL)
+    return MCFG_ERR_UNKNOWN;
+
+  return register_field_n(section, type, name, strlen(name), value,
+                          strlen(value));
+}
+
+/* Size of the input and output buffers of a line source */
+#define SOURCE_CHUNK (32 * 1024)
+
+typedef enum source_format { SF_PLAIN, SF_GZIP, SF_ZSTD } source_format;
+
+/* Reads a file or a buffer chunk by chunk, decompressing it if it starts with
+ * the magic bytes of gzip or zstd. data and len hold the current chunk of
+ * plain text, pos is the offset of the next unread byte. result is set if
+ * reading or decompressing fails. If file is NULL the input is read from
+ * buffer instead.
+ */
+typedef struct line_source {
+  FILE *file;
+  const char *buffer;
+  size_t buffer_len;
+  size_t buffer_pos;
+  mcfg_allocator *allocator;
+  source_format format;
+  int done;
+  int result;
+
+  z_stream gzip;
+#ifdef MCFG_ZSTD
+  ZSTD_DStream *zstd;
+  size_t zstd_ret;
+#endif
+
+  unsigned char *data;
+  size_t len;
+  size_t pos;
+
+  size_t in_len;
+  size_t in_pos;
+  unsigned char in[SOURCE_CHUNK];
+  unsigned char out[SOURCE_CHUNK];
+} line_source;
+
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+  return mcfg_malloc(opaque, (size_t)items * size);
+}
+
+static void zlib_free(voidpf opaque, voidpf address) {
+  mcfg_free(opaque, address);
+}
+
+/* Reads the next chunk of input once the current one is used up. Returns 0 at
+ * the end of the file.
+ */
+static int refill_input(line_source *src) {
+  if (src->in_pos < src->in_len)
+    return 1;
+
+  if (src->file == NULL) {
+    size_t left = src->buffer_len - src->buffer_pos;
+    src->in_len = left < SOURCE_CHUNK ? left : SOURCE_CHUNK;
+    src->in_pos = 0;
+    memcpy(src->in, src->buffer + src->buffer_pos, src->in_len);
+    src->buffer_pos += src->in_len;
+    return src->in_len > 0;
+  }
+
+  src->in_len = fread(src->in, 1, SOURCE_CHUNK, src->file);
+  src->in_pos = 0;
+  if (src->in_len == 0 && ferror(src->file))
+    src->result = MCFG_ERR_MASK_ERRNO | (errno != 0 ? errno : EIO);
+
+  return src->in_len > 0;
+}
+
+static size_t fill_gzip(line_source *src) {
+  z_stream *z = &src->gzip;
+  z->next_out = src->out;
+  z->avail_out = SOURCE_CHUNK;
+
+  while (z->avail_out == SOURCE_CHUNK && !src->done) {
+    if (!refill_input(src)) {
+      // The input ended within a stream
+      src->result = MCFG_ERR_DECOMPRESS;
+      break;
+    }
+
+    z->next_in = src->in + src->in_pos;
+    z->avail_in = src->in_len - src->in_pos;
+    int ret = inflate(z, Z_NO_FLUSH);
+    src->in_pos = src->in_len - z->avail_in;
+
+    if (ret == Z_STREAM_END) {
+      // Concatenated gzip members are read one after another
+      if (refill_input(src))
+        inflateReset(z);
+      else
+        src->done = 1;
+    } else if (ret != Z_OK) {
+      src->result = ret == Z_MEM_ERROR ? alloc_error(src->allocator)
+                                       : MCFG_ERR_DECOMPRESS;
+      break;
+    }
+  }
+
+  return SOURCE_CHUNK - z->avail_out;
+}
+
+#ifdef MCFG_ZSTD
+static size_t fill_zstd(line_source *src) {
+  ZSTD_outBuffer out = {src->out, SOURCE_CHUNK, 0};
+
+  while (out.pos == 0 && !src->done && src->result == MCFG_OK) {
+    int eof = !refill_input(src);
+    ZSTD_inBuffer in = {src->in, src->in_len, src->in_pos};
+    size_t ret = ZSTD_decompressStream(src->zstd, &out, &in);
+    src->in_pos = in.pos;
+
+    if (ZSTD_isError(ret)) {
+      src->result = MCFG_ERR_DECOMPRESS;
+    } else if (eof && out.pos == 0) {
+      // A return value of 0 means the last frame was completed
+      if (src->zstd_ret != 0)
+        src->result = MCFG_ERR_DECOMPRESS;
+      src->done = 1;
+    }
+
+    if (!ZSTD_isError(ret))
+      src->zstd_ret = ret;
+  }
+
+  return out.pos;
+}
+#endif
+
+/* Makes the next chunk of plain text available, returns 0 at the end */
+static int fill_source(line_source *src) {
+  if (src->result != MCFG_OK)
+    return 0;
+
+  src->pos = 0;
+  switch (src->format) {
+  case SF_GZIP:
+    src->data = src->out;
+    src->len = fill_gzip(src);
+    break;
+#ifdef MCFG_ZSTD
+  case SF_ZSTD:
+    src->data = src->out;
+    src->len = fill_zstd(src);
+    break;
+#endif
+  default:
+    src->data = src->in;
+    src->in_pos = src->in_len;
+    src->len = refill_input(src) ? src->in_len : 0;
+    break;
+  }
+
+  return src->len > 0;
+}
+
+/* Detects the format of the data from the magic bytes at its start */
+static source_format detect_format(const unsigned char *data, size_t len) {
+  if (len >= 2 && data[0] == 0x1f && data[1] == 0x8b)
+    return SF_GZIP;
+
+  if (len >= 4 && data[0] == 0x28 && data[1] == 0xb5 && data[2] == 0x2f &&
+      data[3] == 0xfd)
+    return SF_ZSTD;
+
+  return SF_PLAIN;
+}
+
+static void release_input(line_source *src) {
+  if (src->file != NULL)
+    fclose(src->file);
+}
+
+/* Reads the first chunk of input and sets up decompression if required, the
+ * input is released if this fails.
+ */
+static int start_source(line_source *src, mcfg_allocator *allocator) {
+  src->allocator = allocator;
+  src->format = SF_PLAIN;
+  src->done = 0;
+  src->result = MCFG_OK;
+  src->in_len = 0;
+  src->in_pos = 0;
+
+  // The first chunk is kept, as plain text it is the first chunk of data
+  if (!refill_input(src) && src->result != MCFG_OK) {
+    release_input(src);
+    return src->result;
+  }
+
+  src->data = src->in;
+  src->len = src->in_len;
+  src->pos = 0;
+
+  source_format format = detect_format(src->in, src->in_len);
+  if (format == SF_GZIP) {
+    src->format = SF_GZIP;
+    src->len = 0;
+    src->gzip = (z_stream){.zalloc = zlib_alloc,
+                           .zfree = zlib_free,
+                           .opaque = allocator};
+
+    // 16 selects the gzip format
+    int ret = inflateInit2(&src->gzip, 16 + MAX_WBITS);
+    if (ret != Z_OK) {
+      release_input(src);
+      return ret == Z_MEM_ERROR ? alloc_error(allocator) : MCFG_ERR_DECOMPRESS;
+    }
+  } else if (format == SF_ZSTD) {
+#ifdef MCFG_ZSTD
+    src->format = SF_ZSTD;
+    src->len = 0;
+    src->zstd_ret = 0;
+    src->zstd = ZSTD_createDStream();
+    if (src->zstd == NULL) {
+      release_input(src);
+      return alloc_error(allocator);
+    }
+    ZSTD_initDStream(src->zstd);
+#else
+    // Support for zstd is only built in if MCFG_ZSTD is defined
+    release_input(src);
+    return MCFG_ERR_DECOMPRESS;
+#endif
+  }
+
+  return MCFG_OK;
+}
+
+static int open_source(line_source *src, char *path,
+                       mcfg_allocator *allocator) {
+  errno = 0;
+  src->file = fopen(path, "r");
+  if (src->file == NULL)
+    return MCFG_ERR_MASK_ERRNO | errno;
+
+  return start_source(src, allocator);
+}
+
+static int open_buffer_source(line_source *src, const char *buffer,
+                              size_t len, mcfg_allocator *allocator) {
+  src->file = NULL;
+  src->buffer = buffer;
+  src->buffer_len = len;
+  src->buffer_pos = 0;
+
+  return start_source(src, allocator);
+}
+
+static void close_source(line_source *src) {
+  if (src->format == SF_GZIP)
+    inflateEnd(&src->gzip);
+#ifdef MCFG_ZSTD
+  if (src->format == SF_ZSTD)
+    ZSTD_freeDStream(src->zstd);
+#endif
+
+  release_input(src);
+}
+
+/* Reads the next line including its newline into *line, growing it through
+ * the allocator as needed. Returns 0 at the end of the input.
+ */
+static int read_line(mcfg_allocator *allocator, line_source *src, char **line,
+                     size_t *cap) {
+  size_t len = 0;
+
+  // Failing allocations end the input, the error is kept in src->result
+  if (*line == NULL) {
+    *line = mcfg_malloc(allocator, 256);
+    if (*line == NULL) {
+      src->result = alloc_error(allocator);
+      return 0;
+    }
+    *cap = 256;
+  }
+
+  while (src->pos < src->len || fill_source(src)) {
+    unsigned char *start = src->data + src->pos;
+    size_t avail = src->len - src->pos;
+    unsigned char *newline = memchr(start, '\n', avail);
+    size_t take = newline == NULL ? avail : (size_t)(newline - start) + 1;
+
+    if (len + take + 1 > *cap) {
+      size_t new_cap = *cap;
+      while (len + take + 1 > new_cap)
+        new_cap *= 2;
+
+      char *grown = mcfg_realloc(allocator, *line, new_cap);
+      if (grown == NULL) {
+        src->result = alloc_error(allocator);
+        return 0;
+      }
+      *line = grown;
+      *cap = new_cap;
+    }
+
+    memcpy(*line + len, start, take);
+    len += take;
+    src->pos += take;
+
+    if (newline != NULL)
+      break;
+  }
+
+  (*line)[len] = 0;
+  return len > 0;
+}
+
+/* Parses a file, or the buffer if it is not NULL, through a line source */
+static int parse_stream_with_allocator(mcfg_stream *stream, char *buffer,
+                                       size_t len, mcfg_allocator *allocator) {
+  char *line = NULL;
+  size_t cap = 0;
+
+  line_source *src = mcfg_malloc(allocator, sizeof(line_source));
+  if (src == NULL)
+    return alloc_error(allocator);
+
+  int result = buffer != NULL
+                   ? open_buffer_source(src, buffer, len, allocator)
+                   : open_source(src, stream->path, allocator);
+  if (result != MCFG_OK) {
+    mcfg_free(allocator, src);
+    return result;
+  }
+
+  stream->line = 0;
+  stream->column = 0;
+
+  while (read_line(allocator, src, &line, &cap)) {
+    stream->line++;
+    result = parse_stream_line(stream, line);
+    if (result != MCFG_OK)
+      break;
+  }
+
+  if (result == MCFG_OK)
+    result = src->result;
+
+  close_source(src);
+  mcfg_free(allocator, src);
+  mcfg_free(allocator, line);
+
+  return result;
+}
+
+static int parse_stream_span(mcfg_stream *stream, char *line, int len);
+
+/* Parses the file under stream->path using the line buffer of the storage,
+ * the file is read with plain read calls since stdio allocates its buffers.
+ */
+static int parse_stream_storage(mcfg_stream *stream, mcfg_storage *storage) {
+  int fd = open(stream->path, O_RDONLY);
+  if (fd < 0)
+    return MCFG_ERR_MASK_ERRNO | errno;
+
+  stream->line = 0;
+  stream->column = 0;
+
+  char *buffer = storage->line;
+  size_t start = 0;
+  size_t end = 0;
+  int eof = 0;
+  int result = MCFG_OK;
+
+  while (start < end || !eof) {
+    char *newline = memchr(buffer + start, '\n', end - start);
+
+    if (newline == NULL && !eof) {
+      if (start == 0 && end == MCFG_MAX_LINE) {
+        result = MCFG_ERR_CAPACITY;
+        break;
+      }
+
+      memmove(buffer, buffer + start, end - start);
+      end -= start;
+      start = 0;
+
+      ssize_t n = read(fd, buffer + end, MCFG_MAX_LINE - end);
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n < 0) {
+        result = MCFG_ERR_MASK_ERRNO | errno;
+        break;
+      }
+
+      eof = n == 0;
+      end += n;
+      continue;
+    }
+
+    char *line_end = newline == NULL ? buffer + end : newline;
+    stream->line++;
+    result = parse_stream_span(stream, buffer + start,
+                               line_end - (buffer + start));
+    if (result != MCFG_OK)
+      break;
+
+    start = line_end - buffer + (newline != NULL);
+  }
+
+  close(fd);
+
+  return result;
+}
+
+/* Parses a buffer line by line, the buffer is not modified apart from
+ * temporary changes made by the callbacks.
+ */
+static int parse_stream_buffer(mcfg_stream *stream, char *buffer, size_t len) {
+  stream->line = 0;
+  stream->column = 0;
+
+  char *end = buffer + len;
+  while (buffer < end) {
+    char *newline = memchr(buffer, '\n', end - buffer);
+    char *line_end = newline == NULL ? end : newline;
+
+    stream->line++;
+    int result = parse_stream_span(stream, buffer, line_end - buffer);
+    if (result != MCFG_OK)
+      return result;
+
+    buffer = line_end + 1;
+  }
+
+  return MCFG_OK;
+}
+
+/* Tree builder; Materializes the events of the streaming parser into a
+ * mcfg_file, sections rejected by the filter are skipped.
+ */
+
+typedef struct tree_builder {
+  mcfg_file *file;
+  mcfg_section_filter filter;
+  void *filter_user;
+  int skipping;
+} tree_builder;
+
+static int build_sector(void *user, char *name, int len) {
+  tree_builder *builder = user;
+  builder->skipping = 0;
+
+  return register_sector_n(builder->file, name, len);
+}
+
+static int build_section(void *user, mcfg_stype type, char *name, int len) {
+  tree_builder *builder = user;
+  mcfg_file *file = builder->file;
+  mcfg_sector *sector = &file->sectors[file->sector_count - 1];
+
+  if (builder->filter != NULL) {
+    // The name is followed by its colon, so it can be terminated in place
+    char colon = name[len];
+    name[len] = 0;
+    builder->skipping =
+        !builder->filter(builder->filter_user, sector->name, name);
+    name[len] = colon;
+
+    if (builder->skipping)
+      return MCFG_OK;
+  }
+
+  return register_section_n(sector, type, name, len);
+}
+
+static int build_field(void *user, mcfg_ftype type, char *name, int name_len,
+                       char *value, int value_len) {
+  tree_builder *builder = user;
+  if (builder->skipping)
+    return MCFG_OK;
+
+  return register_field_n(current_section(builder->file), type, name,
+                          name_len, value, value_len);
+}
+
+static int build_line(void *user, char *line, int len) {
+  tree_builder *builder = user;
+  if (builder->skipping)
+    return MCFG_OK;
+
+  return append_line(current_section(builder->file), line, len);
+}
+
+static int build_import(void *user, char *path, int len) {
+  tree_builder *builder = user;
+
+  // Fragments live in the import cache on the heap
+  if (allocator_storage(builder->file->allocator) != NULL)
+    return MCFG_ERR_CAPACITY;
+
+  return import_file(builder->file, path, len);
+}
+
+static void init_tree_stream(mcfg_stream *stream, tree_builder *builder) {
+  mcfg_file *file = builder->file;
+  mcfg_section *section = current_section(file);
+
+  stream->path = file->path;
+  stream->line = file->line;
+  stream->column = 0;
+  stream->user = builder;
+  stream->on_sector = build_sector;
+  stream->on_section = build_section;
+  stream->on_field = build_field;
+  stream->on_line = build_line;
+  stream->on_import = build_import;
+  stream->in_sector = file->sector_count > 0;
+  stream->section_type = section == NULL ? ST_UNKNOWN : section->type;
+}
+
+/* Parses into the given file, from buffer if it is not NULL or otherwise from
+ * the file under file->path.
+ */
+static int parse_file_tree(struct mcfg_file *file, mcfg_allocator *allocator,
+                           mcfg_section_filter filter, void *filter_user,
+                           char *buffer, size_t len) {
+  file->sector_count = 0;
+  file->sectors = NULL;
+  file->line = 0;
+  file->column = 0;
+  file->import_count = 0;
+  file->imports = NULL;
+  file->import_paths = NULL;
+  file->allocator = allocator == NULL ? global_allocator : allocator;
+  file->generation = next_generation();
+  file->revision = file->generation;
+
+  tree_builder builder = {file, filter, filter_user, 0};
+  mcfg_stream stream;
+  init_tree_stream(&stream, &builder);
+
+  mcfg_storage *storage = allocator_storage(file->allocator);
+  int ret;
+  // Compressed buffers are decompressed chunk by chunk, plain text buffers
+  // are parsed in place
+  if (buffer != NULL && storage == NULL &&
+      detect_format((unsigned char *)buffer, len) != SF_PLAIN)
+    ret = parse_stream_with_allocator(&stream, buffer, len, file->allocator);
+  else if (buffer != NULL)
+    ret = parse_stream_buffer(&stream, buffer, len);
+  else if (storage != NULL)
+    ret = parse_stream_storage(&stream, storage);
+  else
+    ret = parse_stream_with_allocator(&stream, NULL, 0, file->allocator);
+
+  file->line = stream.line;
+  file->column = stream.column;
+
+  if (ret == MCFG_OK)
+    update_mcfg_hashes(file);
+
+  return ret;
+}
+
+int parse_line(struct mcfg_file *file, char *line) {
+  tree_builder builder = {file, NULL, NULL, 0};
+  mcfg_stream stream;
+  init_tree_stream(&stream, &builder);
+
+  int ret = parse_stream_line(&stream, line);
+  if (ret != MCFG_OK)
+    file->column = stream.column;
+
+  return ret;
+}
+
+int parse_file(struct mcfg_file *build_file) {
+  return parse_file_tree(build_file, NULL, NULL, NULL, NULL, 0);
+}
+
+int parse_file_with_allocator(struct mcfg_file *build_file,
+                              mcfg_allocator *allocator) {
+  return parse_file_tree(build_file, allocator, NULL, NULL, NULL, 0);
+}
+
+int parse_file_filtered(struct mcfg_file *file, mcfg_section_filter filter,
+                        void *user) {
+  return parse_file_tree(file, NULL, filter, user, NULL, 0);
+}
+
+int parse_buffer(struct mcfg_file *file, char *buffer, size_t len) {
+  return parse_file_tree(file, NULL, NULL, NULL, buffer, len);
+}
+
+void init_mcfg_storage(mcfg_storage *storage) {
+  storage->allocator.malloc = storage_malloc;
+  storage->allocator.realloc = storage_realloc;
+  storage->allocator.free = storage_free;
+  storage->allocator.ctx = storage;
+  storage->sector_count = 0;
+  storage->section_count = 0;
+  storage->field_count = 0;
+  storage->string_offs = 0;
+  storage->last_offs = 0;
+}
+
+int parse_file_static(struct mcfg_file *file, mcfg_storage *storage) {
+  init_mcfg_storage(storage);
+  return parse_file_tree(file, &storage->allocator, NULL, NULL, NULL, 0);
+}
+
+int parse_buffer_static(struct mcfg_file *file, mcfg_storage *storage,
+                        char *buffer, size_t len) {
+  init_mcfg_storage(storage);
+  return parse_file_tree(file, &storage->allocator, NULL, NULL, buffer, len);
+}
+
+/* Streaming Parser */
+
+/* Parses a line of the given length, the line does not have to be
+ * terminated.
+ */
+static int parse_stream_span(mcfg_stream *stream, char *line, int len) {
+  line_token token;
+  int ret = lex_line(line, len, stream->section_type == ST_LINES, &token);
+
+  if (ret == MCFG_OK) {
+    switch (token.kind) {
+    case LK_EMPTY:
+      break;
+    case LK_SECTOR:
+      stream->in_sector = 1;
+      stream->section_type = ST_UNKNOWN;
+      if (stream->on_sector != NULL)
+        ret = stream->on_sector(stream->user, token.name, token.name_len);
+      break;
+    case LK_SECTION:
+      if (!stream->in_sector) {
+        ret = MCFG_PERR_INVALID_SYNTAX;
+        break;
+      }
+
+      stream->section_type = strtostype(token.keyword, token.keyword_len);
+      if (stream->on_section != NULL)
+        ret = stream->on_section(stream->user, stream->section_type,
+                                 token.name, token.name_len);
+      break;
+    case LK_IMPORT:
+      if (stream->on_import != NULL)
+        ret = stream->on_import(stream->user, token.value, token.value_len);
+      break;
+    case LK_FIELD:
+      if (stream->section_type == ST_UNKNOWN) {
+        ret = MCFG_PERR_INVALID_SYNTAX;
+        break;
+      }
+
+      mcfg_ftype type = strtoftype(token.keyword, token.keyword_len);
+      if (type == FT_UNKNOWN) {
+        token.column = token.keyword - line + 1;
+        ret = MCFG_PERR_INVALID_FTYPE;
+        break;
+      }
+
+      if (stream->on_field != NULL)
+        ret = stream->on_field(stream->user, type, token.name, token.name_len,
+                               token.value, token.value_len);
+      break;
+    case LK_LINE:
+      if (stream->on_line != NULL)
+        ret = stream->on_line(stream->user, token.value, token.value_len);
+      break;
+    }
+  }
+
+  if (ret != MCFG_OK)
+    stream->column = token.column;
+
+  return ret;
+}
+
+int parse_stream_line(mcfg_stream *stream, char *line) {
+  return parse_stream_span(stream, line, strlen(line));
+}
+
+int parse_stream(mcfg_stream *stream) {
+  stream->in_sector = 0;
+  stream->section_type = ST_UNKNOWN;
+
+  return parse_stream_with_allocator(stream, NULL, 0, global_allocator);
+}
+
+/* Navigation Functions */
+
+/* Splits the given path into its first n elements, the elements point into
+ * the path. Returns the amount of elements found.
+ */
+static int split_path(char *path, char **elems, int *lens, int n) {
+  if (path == NULL)
+    return 0;
+
+  int found = 0;
+  while (found < n) {
+    char *end = strchr(path, '/');
+    elems[found] = path;
+    lens[found] = end == NULL ? strlen(path) : end - path;
+    found++;
+
+    if (end == NULL)
+      break;
+    path = end + 1;
+  }
+
+  return found;
+}
 
-static mcfg_stype strtostype(char *str) {
-  if (strcmp(str, "fields") == 0)
-    return ST_FIELDS;
+static int name_equals(char *name, char *span, int len) {
+  return strncmp(name, span, len) == 0 && name[len] == 0;
+}
 
-  if (strcmp(str, "lines") == 0)
-    return ST_LINES;
+static int sector_index(struct mcfg_file *file, char *name, int len) {
+  for (int i = 0; i < file->sector_count; i++)
+    if (name_equals(file->sectors[i].name, name, len))
+      return i;
 
-  return ST_UNKNOWN;
+  return -1;
 }
 
-static mcfg_ftype strtoftype(char *str) {
-  if (strcmp(str, "str") == 0)
-    return FT_STRING;
+static int section_index(mcfg_sector *sector, char *name, int len) {
+  for (int i = 0; i < sector->section_count; i++)
+    if (name_equals(sector->sections[i].name, name, len))
+      return i;
 
-  if (strcmp(str, "list") == 0)
-    return FT_LIST;
+  return -1;
+}
 
-  return FT_UNKNOWN;
+static int field_index(mcfg_section *section, char *name, int len) {
+  for (int i = 0; i < section->field_count; i++)
+    if (name_equals(section->fields[i].name, name, len))
+      return i;
+
+  return -1;
 }
 
-/******** mcfg.h ********/
+static mcfg_sector *find_local_sector(struct mcfg_file *file,
+                                      char *sector_name, int len) {
+  for (int i = 0; i < file->sector_count; i++)
+    if (name_equals(file->sectors[i].name, sector_name, len))
+      return &file->sectors[i];
 
-void free_mcfg_file(mcfg_file *file) {
-  for (int i = 0; i < file->sector_count; i++) {
-    for (int j = 0; j < file->sectors[i].section_count; j++) {
-      for (int k = 0; k < file->sectors[i].sections[j].field_count; k++) {
-        free(file->sectors[i].sections[j].fields[k].name);
-        free(file->sectors[i].sections[j].fields[k].value);
-      }
+  return NULL;
+}
+
+static mcfg_section *find_local_section(struct mcfg_file *file, char **elems,
+                                        int *lens) {
+  mcfg_sector *sector = find_local_sector(file, elems[0], lens[0]);
+  if (sector == NULL)
+    return NULL;
 
-      if (file->sectors[i].sections[j].field_count > 0)
-        free(file->sectors[i].sections[j].fields);
-      free(file->sectors[i].sections[j].name);
+  for (int i = 0; i < sector->section_count; i++)
+    if (name_equals(sector->sections[i].name, elems[1], lens[1]))
+      return &sector->sections[i];
 
-      if (file->sectors[i].sections[j].lines != NULL)
-        free(file->sectors[i].sections[j].lines);
-    }
+  return NULL;
+}
 
-    free(file->sectors[i].sections);
-    free(file->sectors[i].name);
-  }
+static mcfg_field *find_local_field(struct mcfg_file *file, char **elems,
+                                    int *lens) {
+  mcfg_section *section = find_local_section(file, elems, lens);
+  if (section == NULL)
+    return NULL;
 
-  free(file->sectors);
-  free(file);
+  for (int i = 0; i < section->field_count; i++)
+    if (name_equals(section->fields[i].name, elems[2], lens[2]))
+      return &section->fields[i];
+
+  return NULL;
 }
 
-/* Parsing Functions */
+static mcfg_sector *lookup_sector(struct mcfg_file *file, char *sector_name) {
+  mcfg_sector *sector =
+      find_local_sector(file, sector_name, strlen(sector_name));
 
-int register_sector(struct mcfg_file *file, char *name) {
-  if (name == NULL)
-    return MCFG_ERR_UNKNOWN;
+  for (int i = 0; sector == NULL && i < file->import_count; i++)
+    sector = lookup_sector(file->imports[i], sector_name);
 
-  // Check for duplicate sectors
-  for (int i = 0; i < file->sector_count; i++)
-    if (strcmp(file->sectors[i].name, name) == 0)
-      return MCFG_PERR_DUPLICATE_SECTOR;
+  return sector;
+}
 
-  int wi = file->sector_count;
-  file->sector_count++;
+static mcfg_section *lookup_section(struct mcfg_file *file, char *path) {
+  char *elems[2];
+  int lens[2];
 
-  if (wi == 0) {
-    file->sectors = malloc(sizeof(mcfg_sector));
-  } else {
-    file->sectors = realloc(file->sectors, (wi + 1) * sizeof(mcfg_sector));
-  }
+  if (split_path(path, elems, lens, 2) < 2)
+    return NULL;
 
-  file->sectors[wi].section_count = 0;
-  file->sectors[wi].name = strdup(name);
+  mcfg_section *section = find_local_section(file, elems, lens);
 
-  return MCFG_OK;
+  for (int i = 0; section == NULL && i < file->import_count; i++)
+    section = lookup_section(file->imports[i], path);
+
+  return section;
 }
 
-int register_section(struct mcfg_sector *sector, mcfg_stype type, char *name) {
-  if (name == NULL)
-    return MCFG_ERR_UNKNOWN;
+static mcfg_field *lookup_field(struct mcfg_file *file, char *path) {
+  char *elems[3];
+  int lens[3];
 
-  // Check for duplicate sections
-  for (int i = 0; i < sector->section_count; i++)
-    if (strcmp(sector->sections[i].name, name) == 0)
-      return MCFG_PERR_DUPLICATE_SECTION;
+  if (split_path(path, elems, lens, 3) < 3)
+    return NULL;
 
-  int wi = sector->section_count;
-  sector->section_count++;
+  mcfg_field *field = find_local_field(file, elems, lens);
 
-  if (wi == 0) {
-    sector->sections = malloc(sizeof(mcfg_section));
-  } else {
-    sector->sections =
-        realloc(sector->sections, (wi + 1) * sizeof(mcfg_section));
-  }
+  for (int i = 0; field == NULL && i < file->import_count; i++)
+    field = lookup_field(file->imports[i], path);
 
-  sector->sections[wi].field_count = 0;
-  sector->sections[wi].lines = NULL;
-  sector->sections[wi].name = strdup(name);
-  sector->sections[wi].type = type;
+  return field;
+}
 
-  return MCFG_OK;
+mcfg_sector *find_sector(struct mcfg_file *file, char *sector_name) {
+  trace_span span;
+  if (!trace_begin(&span))
+    return lookup_sector(file, sector_name);
+
+  mcfg_sector *sector = lookup_sector(file, sector_name);
+  trace_end(&span, TK_SECTOR, sector_name, 0);
+
+  return sector;
 }
 
-int register_field(struct mcfg_section *section, mcfg_ftype type, char *name,
-                   char *value) {
-  if (name == NULL || value == NULL)
-    return MCFG_ERR_UNKNOWN;
+mcfg_section *find_section(struct mcfg_file *file, char *path) {
+  trace_span span;
+  if (!trace_begin(&span))
+    return lookup_section(file, path);
 
-  // Check for duplicate fields
-  for (int i = 0; i < section->field_count; i++)
-    if (strcmp(section->fields[i].name, name) == 0)
-      return MCFG_PERR_DUPLICATE_FIELD;
+  mcfg_section *section = lookup_section(file, path);
+  trace_end(&span, TK_SECTION, path, 0);
 
-  int wi = section->field_count;
-  section->field_count++;
+  return section;
+}
 
-  if (wi == 0) {
-    section->fields = malloc(sizeof(mcfg_field));
-  } else {
-    section->fields = realloc(section->fields, (wi + 1) * sizeof(mcfg_field));
-  }
+mcfg_field *find_field(struct mcfg_file *file, char *path) {
+  trace_span span;
+  if (!trace_begin(&span))
+    return lookup_field(file, path);
 
-  section->fields[wi].type = type;
-  section->fields[wi].name = strdup(name);
-  section->fields[wi].value = strdup(value);
+  mcfg_field *field = lookup_field(file, path);
+  trace_end(&span, TK_FIELD, path, 0);
+
+  return field;
+}
+
+/* Finds the record under the path of the given depth like the lookup
+ * functions do and stores its position in handle.
+ */
+static int locate_local(struct mcfg_file *file, char **elems, int *lens,
+                        int depth, mcfg_handle *handle) {
+  *handle = (mcfg_handle){file, -1, -1, -1, file->generation};
+
+  handle->sector = sector_index(file, elems[0], lens[0]);
+  if (handle->sector < 0 || depth == 1)
+    return handle->sector >= 0;
+
+  mcfg_sector *sector = &file->sectors[handle->sector];
+  handle->section = section_index(sector, elems[1], lens[1]);
+  if (handle->section < 0 || depth == 2)
+    return handle->section >= 0;
+
+  mcfg_section *section = &sector->sections[handle->section];
+  handle->field = field_index(section, elems[2], lens[2]);
+  return handle->field >= 0;
+}
+
+static int locate(struct mcfg_file *file, char **elems, int *lens, int depth,
+                  mcfg_handle *handle) {
+  if (locate_local(file, elems, lens, depth, handle))
+    return 1;
+
+  for (int i = 0; i < file->import_count; i++)
+    if (locate(file->imports[i], elems, lens, depth, handle))
+      return 1;
+
+  return 0;
+}
+
+int get_mcfg_handle(struct mcfg_file *file, char *path, mcfg_handle *handle) {
+  char *elems[4];
+  int lens[4];
+  int depth = split_path(path, elems, lens, 4);
+
+  if (depth < 1 || depth > 3 || !locate(file, elems, lens, depth, handle)) {
+    *handle = (mcfg_handle){NULL, -1, -1, -1, 0};
+    return MCFG_ERR_UNKNOWN;
+  }
 
   return MCFG_OK;
 }
 
-int parse_line(struct mcfg_file *file, char *line) {
-  char delimiter[] = " ";
-  line = trim_whitespace(line);
-  char *token = strtok(line, delimiter);
+mcfg_sector *handle_sector(mcfg_handle handle) {
+  mcfg_file *file = handle.file;
+  if (file == NULL || handle.generation != file->generation ||
+      handle.sector < 0 || handle.sector >= file->sector_count)
+    return NULL;
 
-  while (token != NULL) {
-    if (strcmp(token, "sector") == 0) {
-      token = strtok(NULL, delimiter);
+  return &file->sectors[handle.sector];
+}
 
-      return register_sector(file, token);
-    } else if (strncmp(";", token, strlen(";")) == 0)
-      break;
+mcfg_section *handle_section(mcfg_handle handle) {
+  mcfg_sector *sector = handle_sector(handle);
+  if (sector == NULL || handle.section < 0 ||
+      handle.section >= sector->section_count)
+    return NULL;
 
-    if (strcmp(token, "fields") == 0 || strcmp(token, "lines") == 0) {
-      mcfg_stype type = strtostype(token);
-      if (type == ST_UNKNOWN)
-        return MCFG_PERR_INVALID_SYNTAX;
+  return &sector->sections[handle.section];
+}
 
-      token = strtok(NULL, delimiter);
+mcfg_field *handle_field(mcfg_handle handle) {
+  mcfg_section *section = handle_section(handle);
+  if (section == NULL || handle.field < 0 ||
+      handle.field >= section->field_count)
+    return NULL;
 
-      if (token == NULL)
-        return MCFG_PERR_INVALID_SYNTAX;
+  return &section->fields[handle.field];
+}
 
-      // Remove the colon at the end of the name
-      token[strlen(token) - 1] = 0;
-      return register_section(&file->sectors[file->sector_count - 1], type,
-                              token);
-    }
+void invalidate_mcfg_handles(struct mcfg_file *file) {
+  file->generation = next_generation();
+  file->revision = file->generation;
+}
 
-    if (file->sector_count == 0)
-      return MCFG_PERR_INVALID_SYNTAX;
+/* Mutation Functions */
+
+typedef enum undo_kind {
+  UNDO_VALUE,
+  UNDO_ADDED_SECTOR,
+  UNDO_ADDED_SECTION,
+  UNDO_ADDED_FIELD,
+  UNDO_REMOVED_FIELD,
+  UNDO_REMOVED_SECTION,
+  UNDO_RENAMED
+} undo_kind;
+
+/* Reverts a single change. The positions are valid as long as the changes
+ * are undone in reverse order. old_field and old_section hold what was
+ * replaced or removed, old_name the name before renaming.
+ */
+struct mcfg_undo {
+  undo_kind kind;
+  int sector;
+  int section;
+  int field;
+  mcfg_field old_field;
+  mcfg_section old_section;
+  char *old_name;
+};
+
+static void *grow_array(mcfg_allocator *allocator, void *array, size_t size) {
+  if (array == NULL)
+    return mcfg_malloc(allocator, size);
+
+  return mcfg_realloc(allocator, array, size);
+}
 
-    if (file->sectors[file->sector_count - 1].section_count == 0)
-      return MCFG_PERR_INVALID_SYNTAX;
+/* Frees what a change replaced or removed once it can no longer be undone */
+static void discard_undo(mcfg_allocator *allocator, struct mcfg_undo *undo) {
+  switch (undo->kind) {
+  case UNDO_VALUE:
+    mcfg_free(allocator, undo->old_field.value);
+    break;
+  case UNDO_REMOVED_FIELD:
+    mcfg_free(allocator, undo->old_field.name);
+    mcfg_free(allocator, undo->old_field.value);
+    break;
+  case UNDO_REMOVED_SECTION:
+    free_section_contents(allocator, &undo->old_section);
+    break;
+  case UNDO_RENAMED:
+    mcfg_free(allocator, undo->old_name);
+    break;
+  default:
+    break;
+  }
+}
 
-    mcfg_sector *sector = &file->sectors[file->sector_count - 1];
-    mcfg_section *section = &sector->sections[sector->section_count - 1];
-
-    if (section->type == ST_FIELDS) {
-      mcfg_ftype type = strtoftype(token);
-      token = strtok(NULL, delimiter);
-      if (token == NULL)
-        return MCFG_PERR_INVALID_SYNTAX;
-
-      char *name = token;
-      char *content = strtok_asm_remain(delimiter);
-      if (content == NULL)
-        return MCFG_PERR_INVALID_SYNTAX;
-
-      // Gets rid of the quotation marks around the value
-      // TODO: Pontentially make this less cancerous
-      char *cleaned_content = malloc(strlen(content) - 1);
-      memcpy(cleaned_content, content + 1, strlen(content) - 2);
-      memcpy(cleaned_content + strlen(content) - 2, str_terminator, 1);
-      free(content);
-
-      int ret = register_field(section, type, name, cleaned_content);
-      free(cleaned_content);
-      return ret;
+static void revert_undo(mcfg_file *file, struct mcfg_undo *undo) {
+  mcfg_allocator *allocator = file_allocator(file);
+  mcfg_sector *sector = &file->sectors[undo->sector];
+  mcfg_section *section =
+      undo->section >= 0 ? &sector->sections[undo->section] : NULL;
+
+  switch (undo->kind) {
+  case UNDO_VALUE:
+    mcfg_free(allocator, section->fields[undo->field].value);
+    section->fields[undo->field] = undo->old_field;
+    break;
+  // Empty arrays are freed, since registering into them allocates new ones
+  case UNDO_ADDED_SECTOR:
+    mcfg_free(allocator, sector->sections);
+    mcfg_free(allocator, sector->name);
+    if (--file->sector_count == 0) {
+      mcfg_free(allocator, file->sectors);
+      file->sectors = NULL;
+    }
+    break;
+  case UNDO_ADDED_SECTION:
+    free_section_contents(allocator, section);
+    if (--sector->section_count == 0) {
+      mcfg_free(allocator, sector->sections);
+      sector->sections = NULL;
+    }
+    break;
+  case UNDO_ADDED_FIELD:
+    mcfg_free(allocator, section->fields[undo->field].name);
+    mcfg_free(allocator, section->fields[undo->field].value);
+    if (--section->field_count == 0) {
+      mcfg_free(allocator, section->fields);
+      section->fields = NULL;
+    }
+    break;
+  case UNDO_REMOVED_FIELD:
+    section->fields = grow_array(allocator, section->fields,
+                                 (section->field_count + 1) *
+                                     sizeof(mcfg_field));
+    memmove(section->fields + undo->field + 1, section->fields + undo->field,
+            (section->field_count - undo->field) * sizeof(mcfg_field));
+    section->fields[undo->field] = undo->old_field;
+    section->field_count++;
+    break;
+  case UNDO_REMOVED_SECTION:
+    sector->sections = grow_array(allocator, sector->sections,
+                                  (sector->section_count + 1) *
+                                      sizeof(mcfg_section));
+    memmove(sector->sections + undo->section + 1,
+            sector->sections + undo->section,
+            (sector->section_count - undo->section) * sizeof(mcfg_section));
+    sector->sections[undo->section] = undo->old_section;
+    sector->section_count++;
+    break;
+  case UNDO_RENAMED:
+    if (undo->field >= 0) {
+      mcfg_free(allocator, section->fields[undo->field].name);
+      section->fields[undo->field].name = undo->old_name;
+      section->fields[undo->field].hash = undo->old_field.hash;
+    } else if (section != NULL) {
+      mcfg_free(allocator, section->name);
+      section->name = undo->old_name;
     } else {
-      // Assemble content
-      char *first_word = strdup(token);
-      char *remain = strtok_asm_remain(delimiter);
-      char *content = NULL;
-      if (remain != NULL) {
-        content = strglue(first_word, delimiter, remain);
-        free(first_word);
-        free(remain);
-      } else {
-        content = first_word;
-      }
+      mcfg_free(allocator, sector->name);
+      sector->name = undo->old_name;
+    }
+    break;
+  }
+}
 
-      // Add missing newline
-      content = realloc(content, strlen(content) + 2);
-      strcpy(content + strlen(content), newline);
+/* Every change may move records, which makes indices over the file stale */
+static void record_undo(mcfg_transaction *txn, struct mcfg_undo undo) {
+  txn->file->revision = next_generation();
 
-      // Write content to section
-      if (section->lines != NULL) {
-        section->lines = realloc(section->lines,
-                                 strlen(section->lines) + strlen(content) + 1);
-        strcpy(section->lines + strlen(section->lines), content);
-      } else {
-        section->lines = strdup(content);
-      }
+  if (txn->count == txn->capacity) {
+    txn->capacity = txn->capacity == 0 ? 16 : txn->capacity * 2;
+    txn->undo = mcfg_realloc(file_allocator(txn->file), txn->undo,
+                             txn->capacity * sizeof(struct mcfg_undo));
+  }
 
-      free(content);
-    }
+  txn->undo[txn->count++] = undo;
+}
+
+static void rollback_to(mcfg_transaction *txn, int count) {
+  int added = 0;
+  if (txn->count > count)
+    txn->file->revision = next_generation();
 
-    token = strtok(NULL, delimiter);
+  while (txn->count > count) {
+    struct mcfg_undo *undo = &txn->undo[--txn->count];
+    added |= undo->kind == UNDO_ADDED_SECTOR ||
+             undo->kind == UNDO_ADDED_SECTION || undo->kind == UNDO_ADDED_FIELD;
+    revert_undo(txn->file, undo);
   }
 
-  return MCFG_OK;
+  // Handles to records added in the meantime would otherwise refer to
+  // whatever is registered at their position next
+  if (added)
+    invalidate_mcfg_handles(txn->file);
 }
 
-int parse_file(struct mcfg_file *build_file) {
-  FILE *file;
-  char *line = NULL;
-  size_t len = 0;
-  ssize_t read;
+static void discard_undo_log(mcfg_transaction *txn) {
+  mcfg_allocator *allocator = file_allocator(txn->file);
+  for (int i = 0; i < txn->count; i++)
+    discard_undo(allocator, &txn->undo[i]);
 
-  errno = 0;
-  file = fopen(build_file->path, "r");
-  if (file == NULL)
-    return MCFG_ERR_MASK_ERRNO | errno;
+  mcfg_free(allocator, txn->undo);
+  txn->undo = NULL;
+  txn->count = 0;
+  txn->capacity = 0;
+}
+
+/* Checks the path for the mutation functions, which only work on files with
+ * a regular allocator.
+ */
+static int mutation_path(mcfg_transaction *txn, char *path, int depth,
+                         char **elems, int *lens) {
+  if (split_path(path, elems, lens, 4) != depth)
+    return MCFG_ERR_UNKNOWN;
+
+  if (allocator_storage(file_allocator(txn->file)) != NULL)
+    return MCFG_ERR_CAPACITY;
+
+  return MCFG_OK;
+}
+
+static int apply_set_field(mcfg_transaction *txn, char *path, mcfg_ftype type,
+                           char *value) {
+  char *elems[4];
+  int lens[4];
+  int result = mutation_path(txn, path, 3, elems, lens);
+  if (result != MCFG_OK || value == NULL)
+    return result != MCFG_OK ? result : MCFG_ERR_UNKNOWN;
+
+  mcfg_file *file = txn->file;
+  int s = sector_index(file, elems[0], lens[0]);
+  if (s < 0) {
+    result = register_sector_n(file, elems[0], lens[0]);
+    if (result != MCFG_OK)
+      return result;
 
-  build_file->sector_count = 0;
-  build_file->line = 0;
+    s = file->sector_count - 1;
+    record_undo(txn, (struct mcfg_undo){UNDO_ADDED_SECTOR, s, -1, -1});
+  }
 
-  while ((read = getline(&line, &len, file)) != -1) {
-    build_file->line++;
-    int result = parse_line(build_file, line);
+  mcfg_sector *sector = &file->sectors[s];
+  int x = section_index(sector, elems[1], lens[1]);
+  if (x < 0) {
+    result = register_section_n(sector, ST_FIELDS, elems[1], lens[1]);
     if (result != MCFG_OK)
       return result;
+
+    x = sector->section_count - 1;
+    record_undo(txn, (struct mcfg_undo){UNDO_ADDED_SECTION, s, x, -1});
+  }
+
+  mcfg_section *section = &sector->sections[x];
+  if (section->type != ST_FIELDS)
+    return MCFG_ERR_UNKNOWN;
+
+  int f = field_index(section, elems[2], lens[2]);
+  if (f < 0) {
+    result = register_field_n(section, type, elems[2], lens[2], value,
+                              strlen(value));
+    if (result == MCFG_OK)
+      record_undo(txn, (struct mcfg_undo){UNDO_ADDED_FIELD, s, x,
+                                          section->field_count - 1});
+    return result;
   }
 
-  fclose(file);
-  if (line)
-    free(line);
+  mcfg_allocator *allocator = file_allocator(file);
+  char *dup = strndup_span(allocator, value, strlen(value));
+  if (dup == NULL)
+    return alloc_error(allocator);
+
+  mcfg_field *field = &section->fields[f];
+  record_undo(txn,
+              (struct mcfg_undo){UNDO_VALUE, s, x, f, .old_field = *field});
+  field->type = type;
+  field->value = dup;
+  field->hash = hash_field(field);
 
   return MCFG_OK;
 }
 
-/* Navigation Functions */
+static int apply_remove_field(mcfg_transaction *txn, char *path) {
+  char *elems[4];
+  int lens[4];
+  mcfg_handle at;
+  int result = mutation_path(txn, path, 3, elems, lens);
+  if (result != MCFG_OK)
+    return result;
 
-/* NOTE: The returned string of this function has to be freed after usage!!!
- */
-char *get_path_elem(char *path, int n_elem) {
-  if (path == NULL)
-    return NULL;
+  if (!locate_local(txn->file, elems, lens, 3, &at))
+    return MCFG_ERR_UNKNOWN;
 
-  char delimiter = '/';
-
-  // We do this atrocity of searching through the string since
-  // this is the only way I could reliably implement this func
-  // without having memory leaks or invalid free's
-  // If anyone can do this nicer without creating memory leaks
-  // or invalid free's, feel free to do so. I have wasted to
-  // much time on this function
-
-  int n = 0;
-  int i = 0;
-  while (n < n_elem) {
-    if (i == strlen(path))
-      return NULL;
-    if (path[i] == delimiter)
-      n++;
-    i++;
+  mcfg_section *section = &txn->file->sectors[at.sector].sections[at.section];
+  record_undo(txn, (struct mcfg_undo){UNDO_REMOVED_FIELD, at.sector,
+                                      at.section, at.field,
+                                      .old_field = section->fields[at.field]});
+
+  section->field_count--;
+  memmove(section->fields + at.field, section->fields + at.field + 1,
+          (section->field_count - at.field) * sizeof(mcfg_field));
+  if (section->field_count == 0) {
+    mcfg_free(file_allocator(txn->file), section->fields);
+    section->fields = NULL;
   }
 
-  // Get len
-  int len = 1;
+  invalidate_mcfg_handles(txn->file);
 
-  while ((i + len) < strlen(path)) {
-    if (path[i + len] == delimiter)
-      break;
+  return MCFG_OK;
+}
 
-    len++;
-  }
+static int apply_remove_section(mcfg_transaction *txn, char *path) {
+  char *elems[4];
+  int lens[4];
+  mcfg_handle at;
+  int result = mutation_path(txn, path, 2, elems, lens);
+  if (result != MCFG_OK)
+    return result;
 
-  char *result = malloc(len + 1);
-  memcpy(result, path + i, len);
-  memcpy(result + len, str_terminator, 1);
+  if (!locate_local(txn->file, elems, lens, 2, &at))
+    return MCFG_ERR_UNKNOWN;
 
-  return result;
-}
+  mcfg_sector *sector = &txn->file->sectors[at.sector];
+  record_undo(txn,
+              (struct mcfg_undo){UNDO_REMOVED_SECTION, at.sector, at.section,
+                                 -1, .old_section =
+                                         sector->sections[at.section]});
+
+  sector->section_count--;
+  memmove(sector->sections + at.section, sector->sections + at.section + 1,
+          (sector->section_count - at.section) * sizeof(mcfg_section));
+  if (sector->section_count == 0) {
+    mcfg_free(file_allocator(txn->file), sector->sections);
+    sector->sections = NULL;
+  }
 
-mcfg_sector *find_sector(struct mcfg_file *file, char *sector_name) {
-  for (int i = 0; i < file->sector_count; i++)
-    if (strcmp(file->sectors[i].name, sector_name) == 0)
-      return &file->sectors[i];
+  invalidate_mcfg_handles(txn->file);
 
-  return NULL;
+  return MCFG_OK;
 }
 
-mcfg_section *find_section(struct mcfg_file *file, char *path) {
-  char *sector_name = get_path_elem(path, 0);
-  char *section_name = get_path_elem(path, 1);
+static int apply_rename(mcfg_transaction *txn, char *path, char *name) {
+  char *elems[4];
+  int lens[4];
+  mcfg_handle at;
+  int depth = split_path(path, elems, lens, 4);
+  if (name == NULL || depth < 1 || depth > 3)
+    return MCFG_ERR_UNKNOWN;
 
-  if ((sector_name == NULL) || (section_name == NULL))
-    return NULL;
+  int result = mutation_path(txn, path, depth, elems, lens);
+  if (result != MCFG_OK)
+    return result;
 
-  mcfg_sector *sector = find_sector(file, sector_name);
-  free(sector_name);
+  mcfg_file *file = txn->file;
+  if (!locate_local(file, elems, lens, depth, &at))
+    return MCFG_ERR_UNKNOWN;
 
-  if (sector == NULL) {
-    return NULL;
+  int len = strlen(name);
+  mcfg_sector *sector = &file->sectors[at.sector];
+  mcfg_section *section =
+      at.section >= 0 ? &sector->sections[at.section] : NULL;
+  char **target;
+  int duplicate;
+  uint64_t old_hash = 0;
+
+  switch (depth) {
+  case 1:
+    target = &sector->name;
+    duplicate = sector_index(file, name, len);
+    result = MCFG_PERR_DUPLICATE_SECTOR;
+    break;
+  case 2:
+    target = &section->name;
+    duplicate = section_index(sector, name, len);
+    result = MCFG_PERR_DUPLICATE_SECTION;
+    break;
+  default:
+    target = &section->fields[at.field].name;
+    duplicate = field_index(section, name, len);
+    old_hash = section->fields[at.field].hash;
+    result = MCFG_PERR_DUPLICATE_FIELD;
+    break;
   }
 
-  mcfg_section *section = NULL;
-  for (int i = 0; i < sector->section_count; i++) {
-    if (strcmp(sector->sections[i].name, section_name) == 0) {
-      section = &sector->sections[i];
-      break;
-    }
+  if (strcmp(*target, name) == 0)
+    return MCFG_OK;
+
+  if (duplicate >= 0)
+    return result;
+
+  mcfg_allocator *allocator = file_allocator(file);
+  char *dup = strndup_span(allocator, name, len);
+  if (dup == NULL)
+    return alloc_error(allocator);
+
+  record_undo(txn, (struct mcfg_undo){UNDO_RENAMED, at.sector, at.section,
+                                      at.field, .old_field.hash = old_hash,
+                                      .old_name = *target});
+  *target = dup;
+  if (depth == 3)
+    section->fields[at.field].hash = hash_field(&section->fields[at.field]);
+
+  return MCFG_OK;
+}
+
+/* Applies a single change outside of a transaction. Only the hashes along the
+ * changed path are updated instead of those of the whole file.
+ */
+static int finish_single(mcfg_transaction *txn, int result) {
+  if (result != MCFG_OK || txn->count == 0) {
+    discard_undo_log(txn);
+    return result;
   }
 
-  free(section_name);
-  return section;
+  struct mcfg_undo *last = &txn->undo[txn->count - 1];
+  mcfg_sector *sector = &txn->file->sectors[last->sector];
+  if (last->section >= 0 && last->kind != UNDO_REMOVED_SECTION)
+    update_section_hash(&sector->sections[last->section]);
+
+  update_sector_hash(sector);
+  update_file_hash(txn->file);
+  discard_undo_log(txn);
+
+  return MCFG_OK;
 }
 
-mcfg_field *find_field(struct mcfg_file *file, char *path) {
-  char *sector_name = get_path_elem(path, 0);
-  char *section_name = get_path_elem(path, 1);
-  char *field_name = get_path_elem(path, 2);
+int set_field(struct mcfg_file *file, char *path, mcfg_ftype type,
+              char *value) {
+  mcfg_transaction txn;
+  begin_mcfg_transaction(&txn, file, NULL, NULL);
+  return finish_single(&txn, txn_set_field(&txn, path, type, value));
+}
 
-  if ((sector_name == NULL) || (section_name == NULL) || (field_name == NULL))
-    return NULL;
+int remove_field(struct mcfg_file *file, char *path) {
+  mcfg_transaction txn;
+  begin_mcfg_transaction(&txn, file, NULL, NULL);
+  return finish_single(&txn, txn_remove_field(&txn, path));
+}
 
-  sector_name =
-      realloc(sector_name, strlen(sector_name) + strlen(section_name) + 2);
-  mcfg_section *section =
-      find_section(file, strcat(strcat(sector_name, "/"), section_name));
+int remove_section(struct mcfg_file *file, char *path) {
+  mcfg_transaction txn;
+  begin_mcfg_transaction(&txn, file, NULL, NULL);
+  return finish_single(&txn, txn_remove_section(&txn, path));
+}
 
-  free(sector_name);
-  free(section_name);
-  if (section == NULL) {
-    free(field_name);
-    return NULL;
-  }
+int rename_mcfg_path(struct mcfg_file *file, char *path, char *name) {
+  mcfg_transaction txn;
+  begin_mcfg_transaction(&txn, file, NULL, NULL);
+  return finish_single(&txn, txn_rename(&txn, path, name));
+}
 
-  mcfg_field *field = NULL;
+/* Transactions */
 
-  for (int i = 0; i < section->field_count; i++) {
-    if (strcmp(section->fields[i].name, field_name) == 0) {
-      field = &section->fields[i];
+void begin_mcfg_transaction(mcfg_transaction *txn, struct mcfg_file *file,
+                            void (*on_commit)(void *user,
+                                              struct mcfg_file *file),
+                            void *user) {
+  *txn = (mcfg_transaction){.file = file, .on_commit = on_commit, .user = user};
+}
+
+/* Every change either applies completely or is undone right away, count is
+ * the length of the undo log before the change.
+ */
+static int applied(mcfg_transaction *txn, int count, int result) {
+  if (result != MCFG_OK)
+    rollback_to(txn, count);
+
+  return result;
+}
+
+int txn_set_field(mcfg_transaction *txn, char *path, mcfg_ftype type,
+                  char *value) {
+  int count = txn->count;
+  return applied(txn, count, apply_set_field(txn, path, type, value));
+}
+
+int txn_remove_field(mcfg_transaction *txn, char *path) {
+  int count = txn->count;
+  return applied(txn, count, apply_remove_field(txn, path));
+}
+
+int txn_remove_section(mcfg_transaction *txn, char *path) {
+  int count = txn->count;
+  return applied(txn, count, apply_remove_section(txn, path));
+}
+
+int txn_rename(mcfg_transaction *txn, char *path, char *name) {
+  int count = txn->count;
+  return applied(txn, count, apply_rename(txn, path, name));
+}
+
+void commit_mcfg_transaction(mcfg_transaction *txn) {
+  int changed = txn->count > 0;
+  if (changed)
+    update_mcfg_hashes(txn->file);
+
+  discard_undo_log(txn);
+
+  if (changed && txn->on_commit != NULL)
+    txn->on_commit(txn->user, txn->file);
+}
+
+void rollback_mcfg_transaction(mcfg_transaction *txn) {
+  rollback_to(txn, 0);
+  discard_undo_log(txn);
+}
+
+/* Allocator aware versions of strcpy_until and bstrcpy_until from
+ * butter/strutils.
+ */
+static char *copy_until(mcfg_allocator *allocator, char *src,
+                        char delimiter) {
+  int offs = 0;
+  while (src[offs] != 0 && src[offs] != delimiter)
+    offs++;
+
+  if (offs == 0)
+    return "";
+
+  return strndup_span(allocator, src, offs);
+}
+
+static char *bcopy_until(mcfg_allocator *allocator, char *src, char *src_org,
+                         char delimiter) {
+  int offs = 0;
+  while ((src - offs) > src_org) {
+    if ((src - offs)[0] == delimiter)
       break;
-    }
+    offs++;
   }
 
-  free(field_name);
+  if (offs == 0)
+    return "";
 
-  return field;
+  return strndup_span(allocator, src - offs + 1, offs);
 }
 
 char *format_list_field(struct mcfg_file file, mcfg_field field, char *context,
                         char *in, int in_offs, int len) {
   if (in == NULL || strcmp(in, "") == 0)
     return "";
-  char *prefix = bstrcpy_until(in + in_offs - 1, in, ' ');
-  char *postfix = strcpy_until(in + in_offs + len + 1, ' ');
+
+  mcfg_allocator *allocator = file_allocator(&file);
+  char *prefix = bcopy_until(allocator, in + in_offs - 1, in, ' ');
+  char *postfix = copy_until(allocator, in + in_offs + len + 1, ' ');
   int prefix_len = 0;
   int postfix_len = 0;
 
-  if (prefix[strlen(prefix) - 1] == ':' && field.type == FT_LIST) {
-    free(prefix);
+  if (prefix[0] != 0 && prefix[strlen(prefix) - 1] == ':' &&
+      field.type == FT_LIST) {
+    mcfg_free(allocator, prefix);
     prefix = NULL;
   }
 
   if (postfix[0] == ':' && field.type == FT_LIST) {
-    free(postfix);
+    mcfg_free(allocator, postfix);
     postfix = NULL;
   }
 
@@ -413,17 +2478,24 @@ char *format_list_field(struct mcfg_file file, mcfg_field field, char *context,
   char *field_cpy = resolve_fields(file, field.value, context, 1);
 
   char *f_elem = strtok(field_cpy, delimiter);
-  if (f_elem == NULL)
+  if (f_elem == NULL) {
+    mcfg_free(allocator, field_cpy);
+    if (prefix != NULL && strcmp(prefix, "") != 0)
+      mcfg_free(allocator, prefix);
+    if (postfix != NULL && strcmp(postfix, "") != 0)
+      mcfg_free(allocator, postfix);
     return "";
+  }
 
-  char *result = malloc(strlen(f_elem) + prefix_len + postfix_len + 1);
+  char *result =
+      mcfg_malloc(allocator, strlen(f_elem) + prefix_len + postfix_len + 1);
 
   const int base_size = prefix_len + postfix_len + 2;
   int offs = 0;
   while (f_elem != NULL) {
     if (offs > 0) {
-      int size = strlen(result) + strlen(f_elem) + base_size;
-      result = realloc(result, size);
+      int size = offs + strlen(f_elem) + base_size;
+      result = mcfg_realloc(allocator, result, size);
       memcpy(result + offs, " ", 1);
       offs++;
     }
@@ -445,24 +2517,51 @@ char *format_list_field(struct mcfg_file file, mcfg_field field, char *context,
 
   memcpy(result + offs, str_terminator, 1);
 
-  free(field_cpy);
+  mcfg_free(allocator, field_cpy);
   if (prefix != NULL && strcmp(prefix, "") != 0)
-    free(prefix);
+    mcfg_free(allocator, prefix);
   if (postfix != NULL && strcmp(postfix, "") != 0)
-    free(postfix);
+    mcfg_free(allocator, postfix);
 
   return result;
 }
 
+static char *resolve_fields_untraced(struct mcfg_file file, char *in,
+                                     char *context, int leave_lists);
+
+char *resolve_fields(struct mcfg_file file, char *in, char *context,
+                     int leave_lists) {
+  trace_span span;
+  int traced = trace_begin(&span);
+
+  // resolve_max_depth is the deepest level reached below the current call
+  int saved_max_depth = resolve_max_depth;
+  resolve_depth++;
+  resolve_max_depth = resolve_depth;
+
+  char *out = resolve_fields_untraced(file, in, context, leave_lists);
+
+  int depth = resolve_max_depth - resolve_depth + 1;
+  if (saved_max_depth > resolve_max_depth)
+    resolve_max_depth = saved_max_depth;
+  resolve_depth--;
+
+  if (traced)
+    trace_end(&span, TK_RESOLVE, in, depth);
+
+  return out;
+}
+
 /* TODO: This is singlehandidly the worst code ive ever written, this needs a
  * desperate cleanup its so fucking long and confusing
  * */
-char *resolve_fields(struct mcfg_file file, char *in, char *context,
-                     int leave_lists) {
+static char *resolve_fields_untraced(struct mcfg_file file, char *in,
+                                     char *context, int leave_lists) {
+  mcfg_allocator *allocator = file_allocator(&file);
   int n_fields = 0;
-  int *field_indexes = malloc(sizeof(int));
-  int *field_lens = malloc(sizeof(int));
-  char **fieldvals = malloc(sizeof(char *));
+  int *field_indexes = mcfg_malloc(allocator, sizeof(int));
+  int *field_lens = mcfg_malloc(allocator, sizeof(int));
+  char **fieldvals = mcfg_malloc(allocator, sizeof(char *));
 
   // Resolve all fields and store their vals and indexes in the string
   for (int i = 0; i < strlen(in); i++) {
@@ -486,7 +2585,7 @@ char *resolve_fields(struct mcfg_file file, char *in, char *context,
       if (is_local) {
         // Subtract two from length to account for $() = -3
         // and the NULL Byte = +1
-        name = malloc(strlen(context) + (len - 1));
+        name = mcfg_malloc(allocator, strlen(context) + (len - 1));
         memcpy(name, context, strlen(context));
         memcpy(name + strlen(context), in + i + 2, len - 2);
         term_offs += strlen(context);
@@ -495,21 +2594,21 @@ char *resolve_fields(struct mcfg_file file, char *in, char *context,
         int offs = 0;
 
         // Create temporary copy of raw name for prefix checking
-        char *tmp_name = malloc((len - 1));
+        char *tmp_name = mcfg_malloc(allocator, (len - 1));
         memcpy(tmp_name, in + i + 2, len - 2);
         memcpy(tmp_name + len - 2, str_terminator, 1);
 
         if (str_startswith(tmp_name, prefix) != 0) {
-          name = malloc(strlen(prefix) + (len - 1));
+          name = mcfg_malloc(allocator, strlen(prefix) + (len - 1));
           memcpy(name, prefix, strlen(prefix));
           offs += strlen(prefix);
         } else {
-          name = malloc(len - 2);
+          name = mcfg_malloc(allocator, len - 1);
         }
 
         memcpy(name + offs, in + i + 2, len - 2);
         term_offs += offs;
-        free(tmp_name);
+        mcfg_free(allocator, tmp_name);
       }
 
       memcpy(name + term_offs, str_terminator, 1);
@@ -527,9 +2626,12 @@ char *resolve_fields(struct mcfg_file file, char *in, char *context,
 
       n_fields++;
       if (n_fields > 1) {
-        field_indexes = realloc(field_indexes, n_fields * sizeof(int));
-        field_lens = realloc(field_lens, n_fields * sizeof(int));
-        fieldvals = realloc(fieldvals, n_fields * sizeof(char *));
+        field_indexes =
+            mcfg_realloc(allocator, field_indexes, n_fields * sizeof(int));
+        field_lens =
+            mcfg_realloc(allocator, field_lens, n_fields * sizeof(int));
+        fieldvals =
+            mcfg_realloc(allocator, fieldvals, n_fields * sizeof(char *));
       }
 
       field_indexes[n_fields - 1] = i;
@@ -537,13 +2639,13 @@ char *resolve_fields(struct mcfg_file file, char *in, char *context,
       fieldvals[n_fields - 1] = val_tmp;
 
     resolve_fields_stop:
-      free(name);
+      mcfg_free(allocator, name);
     }
   }
 
   char *out = NULL;
   if (n_fields == 0) {
-    out = strdup(in);
+    out = strndup_span(allocator, in, strlen(in));
     goto resolve_fields_finished;
   }
 
@@ -558,9 +2660,10 @@ char *resolve_fields(struct mcfg_file file, char *in, char *context,
 
     // allocate memory (strlen(val) + ix-i_offs)
     if (out == NULL) {
-      out = malloc(strlen(val) + (ix - i_offs));
+      out = mcfg_malloc(allocator, strlen(val) + (ix - i_offs));
     } else {
-      out = realloc(out, o_offs + (strlen(val) + (ix - i_offs)));
+      out = mcfg_realloc(allocator, out,
+                         o_offs + (strlen(val) + (ix - i_offs)));
     }
 
     // copy from in i_offs <-> ix to out with o_offs
@@ -583,22 +2686,22 @@ char *resolve_fields(struct mcfg_file file, char *in, char *context,
   if (i_offs < strlen(in)) {
     int missing = strlen(in) - i_offs;
 
-    out = realloc(out, o_offs + missing);
+    out = mcfg_realloc(allocator, out, o_offs + missing);
     memcpy(out + o_offs, in + i_offs, missing);
     o_offs += missing;
   }
 
   // Append Terminator
-  out = realloc(out, o_offs + 1);
+  out = mcfg_realloc(allocator, out, o_offs + 1);
   memcpy(out + o_offs, str_terminator, 1);
 
 resolve_fields_finished:
-  free(field_indexes);
-  free(field_lens);
+  mcfg_free(allocator, field_indexes);
+  mcfg_free(allocator, field_lens);
   for (int i = 0; i < n_fields; i++)
     if (fieldvals[i] != NULL && strcmp(fieldvals[i], "") != 0)
-      free(fieldvals[i]);
-  free(fieldvals);
+      mcfg_free(allocator, fieldvals[i]);
+  mcfg_free(allocator, fieldvals);
 
   return out;
 }
@@ -13,8 +13,16 @@
 #ifndef MCFG_H
 #define MCFG_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define MCFG_OK 0
 #define MCFG_ERR_UNKNOWN 0x00000001
+#define MCFG_ERR_INVALID_PATTERN 0x00000002
+#define MCFG_ERR_INVALID_IMAGE 0x00000003
+#define MCFG_ERR_CAPACITY 0x00000004
+#define MCFG_ERR_UNREPRESENTABLE 0x00000005
+#define MCFG_ERR_DECOMPRESS 0x00000006
 #define MCFG_PERR_MASK 0x10000000
 #define MCFG_PERR_MISSING_REQUIRED 0x10000001
 #define MCFG_PERR_DUPLICATE_SECTION 0x10000002
@@ -24,6 +32,7 @@
 #define MCFG_PERR_INVALID_SYNTAX 0x10000006
 #define MCFG_PERR_INVALID_FTYPE 0x10000007
 #define MCFG_PERR_INVALID_STYPE 0x10000008
+#define MCFG_PERR_IMPORT_CYCLE 0x10000009
 #define MCFG_ERR_MASK_ERRNO 0xf0000000
 
 /* Used to set the type of a field. If the type ever is FT_UNKOWN an error
@@ -36,12 +45,54 @@ typedef enum mcfg_ftype { FT_STRING, FT_LIST, FT_UNKNOWN } mcfg_ftype;
  */
 typedef enum mcfg_stype { ST_FIELDS, ST_LINES, ST_UNKNOWN } mcfg_stype;
 
+/* Kind of a traced lookup, see set_mcfg_trace_hooks */
+typedef enum mcfg_trace_kind {
+  TK_SECTOR,
+  TK_SECTION,
+  TK_FIELD,
+  TK_RESOLVE
+} mcfg_trace_kind;
+
+/* Allocation hooks used for every allocation made by the library.
+ * ctx is passed through to every call.
+ */
+typedef struct mcfg_allocator {
+  void *(*malloc)(void *ctx, size_t size);
+  void *(*realloc)(void *ctx, void *ptr, size_t size);
+  void (*free)(void *ctx, void *ptr);
+  void *ctx;
+} mcfg_allocator;
+
+/* Capacities of a mcfg_storage. They can be overridden at compile time, but
+ * have to be the same for the library and all of its users.
+ */
+#ifndef MCFG_MAX_SECTORS
+#define MCFG_MAX_SECTORS 16
+#endif
+
+#ifndef MCFG_MAX_SECTIONS
+#define MCFG_MAX_SECTIONS 64
+#endif
+
+#ifndef MCFG_MAX_FIELDS
+#define MCFG_MAX_FIELDS 256
+#endif
+
+#ifndef MCFG_STRING_POOL_SIZE
+#define MCFG_STRING_POOL_SIZE 16384
+#endif
+
+#ifndef MCFG_MAX_LINE
+#define MCFG_MAX_LINE 1024
+#endif
+
 /* Holds a field specified within a config section.
  */
 typedef struct mcfg_field {
   mcfg_ftype type;
   char *name;
   char *value;
+  uint64_t hash;
 } mcfg_field;
 
 /* Defines a section of a sector within a mcfg file
@@ -51,8 +102,11 @@ typedef struct mcfg_section {
   char *name;
   int section_type;
   char *lines;
+  size_t lines_len;
   int field_count;
   mcfg_field *fields;
+  mcfg_allocator *allocator;
+  uint64_t hash;
 } mcfg_section;
 
 /* Defines a sector of a mcfg file
@@ -61,25 +115,190 @@ typedef struct mcfg_sector {
   char *name;
   int section_count;
   mcfg_section *sections;
+  mcfg_allocator *allocator;
+  uint64_t hash;
 } mcfg_sector;
 
 /* C-Representation of a mcfg file
+ *
+ * column holds the column within the current line at which parsing failed.
+ * imports holds the fragments pulled in through import/include directives.
+ * They are owned by the import cache and shared read-only between all files
+ * importing them, see free_mcfg_import_cache. import_paths holds the path of
+ * each import as written in its directive, it may be NULL for files which
+ * were not parsed.
+ * allocator is the allocator used for everything belonging to the file, if
+ * it is NULL the global allocator is taken over on first use.
+ *
+ * Every field, section, sector and the file itself carry a 64-bit hash of
+ * their contents, see update_mcfg_hashes.
+ * generation identifies the current layout of the file for handles, see
+ * mcfg_handle. revision changes with every change made through the mutation
+ * functions (and whenever generation changes), which is used to detect stale
+ * indices.
  */
 typedef struct mcfg_file {
   char *path;
   int line;
+  int column;
   int sector_count;
   mcfg_sector *sectors;
+  int import_count;
+  struct mcfg_file **imports;
+  char **import_paths;
+  mcfg_allocator *allocator;
+  uint64_t hash;
+  unsigned long generation;
+  unsigned long revision;
 } mcfg_file;
 
+/* Stable reference to a sector, section or field.
+ *
+ * Unlike pointers, handles stay valid when records are registered, since
+ * they only hold the position of the record and the generation of the file
+ * containing it. Resolving a handle checks both in constant time. The
+ * generation changes whenever the file is parsed again or records are moved
+ * or removed, which invalidates all of its handles.
+ *
+ * file is the file holding the record, which is an imported fragment if the
+ * record was found through an import. Unused levels are -1.
+ */
+typedef struct mcfg_handle {
+  struct mcfg_file *file;
+  int sector;
+  int section;
+  int field;
+  unsigned long generation;
+} mcfg_handle;
+
+/* A group of changes to a file which are applied in place and can be undone
+ * until the transaction is committed, see begin_mcfg_transaction.
+ *
+ * undo holds count changes in the order they were made. on_commit is called
+ * once per commit which changed anything.
+ */
+typedef struct mcfg_transaction {
+  struct mcfg_file *file;
+  int count;
+  int capacity;
+  struct mcfg_undo *undo;
+  void (*on_commit)(void *user, struct mcfg_file *file);
+  void *user;
+} mcfg_transaction;
+
+/* Fixed storage for a single file which is parsed without any dynamic
+ * allocation, see parse_file_static. Names, values and lines are placed in
+ * the string pool, line is used as the read buffer.
+ *
+ * The storage is meant to be statically allocated, it must not be moved while
+ * the file parsed into it is in use.
+ */
+typedef struct mcfg_storage {
+  mcfg_allocator allocator;
+  int sector_count;
+  int section_count;
+  int field_count;
+  size_t string_offs;
+  size_t last_offs;
+
+  mcfg_sector sectors[MCFG_MAX_SECTORS];
+  mcfg_section sections[MCFG_MAX_SECTIONS];
+  mcfg_field fields[MCFG_MAX_FIELDS];
+  char strings[MCFG_STRING_POOL_SIZE];
+  char line[MCFG_MAX_LINE];
+} mcfg_storage;
+
+/* Allocation Functions */
+
+/* Sets the global allocator which is used for all files that do not have
+ * their own allocator. Passing NULL restores the default allocator, which
+ * uses malloc, realloc and free.
+ *
+ * Notes:
+ *   - The allocator has to stay valid as long as any file allocated through
+ *     it exists.
+ */
+void set_mcfg_allocator(mcfg_allocator *allocator);
+
+/* Returns the current global allocator.
+ */
+mcfg_allocator *get_mcfg_allocator(void);
+
+/* Allocates, reallocates or frees memory through the given allocator or the
+ * global allocator if NULL is passed.
+ */
+void *mcfg_malloc(mcfg_allocator *allocator, size_t size);
+void *mcfg_realloc(mcfg_allocator *allocator, void *ptr, size_t size);
+void mcfg_free(mcfg_allocator *allocator, void *ptr);
+
 /* Completely and recursively free a mcfg_file struct
+ *
+ * Notes:
+ *   - The struct itself is freed using free(), since it is allocated by the
+ *     caller.
+ *   - Imported fragments are not freed, since they are owned by the import
+ *     cache.
  */
 void free_mcfg_file(mcfg_file *file);
 
+/* Frees all fragments held by the import cache.
+ *
+ * Notes:
+ *   - Every mcfg_file which imported a fragment must not be used for lookups
+ *     after calling this, since its imports will point to freed memory.
+ */
+void free_mcfg_import_cache(void);
+
+/* Hashing Functions */
+
+/* Recomputes the hashes of all sections, sectors and the file itself.
+ *
+ * The hash of a field covers its type, name and value and is kept up to date
+ * by register_field. The hashes of sections, sectors and the file combine the
+ * hashes of their names and children independent of their order and are
+ * computed at the end of parsing. They have to be updated using this function
+ * after any other change to the file.
+ *
+ * The hashes are meant for change detection, they are not cryptographic.
+ */
+void update_mcfg_hashes(mcfg_file *file);
+
+/* Stores the hash of the file (empty path or NULL), a sector ("sector"), a
+ * section ("sector/section") or a field ("sector/section/field") in hash.
+ * Returns MCFG_ERR_UNKNOWN if the path can not be found.
+ */
+int get_mcfg_hash(mcfg_file *file, char *path, uint64_t *hash);
+
+/* Tracing Functions */
+
+/* Hooks called after lookups through find_sector, find_section, find_field
+ * and resolve_fields.
+ *
+ * sample_rate: Only every sample_rate-th lookup of each thread is reported,
+ *              0 and 1 report every lookup.
+ * on_lookup  : Receives the path (or the input string for resolve_fields), the
+ *              time the lookup took and for resolve_fields the depth of the
+ *              recursion it caused, 1 if it did not recurse. It is called on
+ *              the thread doing the lookup.
+ */
+typedef struct mcfg_trace_hooks {
+  unsigned sample_rate;
+  void (*on_lookup)(void *user, mcfg_trace_kind kind, char *path,
+                    unsigned long ns, int depth);
+  void *user;
+} mcfg_trace_hooks;
+
+/* Installs the hooks for all threads, NULL disables tracing. The hooks have to
+ * stay valid until lookups running on other threads have finished.
+ */
+void set_mcfg_trace_hooks(mcfg_trace_hooks *hooks);
+
 /* Parsing Functions */
 /* NOTE: After using any of these registering functions, pointers to members
  *       of the targeted mcfg-file need to be reassigned since registering
- *       breaks the old pointers.
+ *       breaks the old pointers. Handles (see mcfg_handle) stay valid.
+ *       A file which is built without parse_file has to be initialised with
+ *       zeroes before registering into it.
  */
 
 /* Register a sector into the provided mcfg_file struct
@@ -120,20 +339,234 @@ int register_field(struct mcfg_section *section, mcfg_ftype type, char *name,
                    char *value);
 
 /* Parses the provided line for the provided mcfg_file struct
+ *
+ * Notes:
+ *   - Field values have to be enclosed in single or double quotes, their
+ *     content is taken over byte for byte.
+ *   - If parsing fails, file->column is set to the column of the offending
+ *     token.
+ *   - A line of the form "import 'path'" or "include 'path'" imports the
+ *     given mcfg file. Relative paths are resolved against the directory of
+ *     file->path. Each fragment is parsed only once per process (as long as
+ *     its inode and mtime stay the same) and shared by all files importing
+ *     it. Lookups fall back to the imports in order of their declaration if
+ *     a path can not be found within the file itself.
+ *   - Import directives are not recognised within lines sections.
  */
 int parse_line(struct mcfg_file *file, char *line);
 
 /* Parses the file under the path in file->path line by line,
  * will return MCFG_OK if there were no errors.
+ *
+ * Files compressed with gzip, or with zstd if the library was built with
+ * MCFG_ZSTD defined, are recognised by their magic bytes and decompressed
+ * while parsing. Only a fixed size buffer is used for this, the decompressed
+ * file is never held in memory as a whole. Corrupt or truncated input and
+ * zstd input without zstd support fail with MCFG_ERR_DECOMPRESS.
+ * This applies to everything reading files by path, including imports and
+ * parse_stream, but not to parse_file_static.
  */
 int parse_file(struct mcfg_file *file);
 
+/* Like parse_file, but everything belonging to the file is allocated through
+ * the given allocator. If allocator is NULL, the global allocator is used.
+ */
+int parse_file_with_allocator(struct mcfg_file *file,
+                              mcfg_allocator *allocator);
+
+/* Parses the given buffer like parse_file would parse a file with the same
+ * contents. file->path is only used to resolve relative imports and may be
+ * NULL.
+ *
+ * Notes:
+ *   - The buffer does not have to be terminated and is not modified.
+ *   - Buffers compressed with gzip or zstd are recognised and decompressed
+ *     like files, this is not supported by parse_buffer_static.
+ */
+int parse_buffer(struct mcfg_file *file, char *buffer, size_t len);
+
+/* Resets the storage, all files parsed into it become invalid.
+ */
+void init_mcfg_storage(mcfg_storage *storage);
+
+/* Like parse_file and parse_buffer, but the file is placed in the given
+ * storage and nothing is allocated. Running out of any of the capacities of
+ * the storage fails with MCFG_ERR_CAPACITY, so do lines which are longer than
+ * MCFG_MAX_LINE when reading from a file.
+ *
+ * Notes:
+ *   - The storage is reset first, it holds only one file at a time.
+ *   - Imports are not supported and fail with MCFG_ERR_CAPACITY.
+ *   - The file must not be freed using free_mcfg_file unless it was
+ *     allocated with malloc, the storage does not need to be freed.
+ *   - resolve_fields and format_list_field allocate their results and can
+ *     not be used with files placed in a storage.
+ */
+int parse_file_static(struct mcfg_file *file, mcfg_storage *storage);
+int parse_buffer_static(struct mcfg_file *file, mcfg_storage *storage,
+                        char *buffer, size_t len);
+
+/* Decides whether a section is kept by parse_file_filtered, returns 0 to skip
+ * the section.
+ */
+typedef int (*mcfg_section_filter)(void *user, char *sector, char *section);
+
+/* Like parse_file, but only the sections accepted by the filter are
+ * materialized. The content of all other sections is skipped while reading.
+ */
+int parse_file_filtered(struct mcfg_file *file, mcfg_section_filter filter,
+                        void *user);
+
+/* Streaming Parser */
+
+/* State and callbacks of the streaming parser.
+ *
+ * The parser reports every sector, section, field and line of a lines
+ * section through the callbacks instead of building a mcfg_file, so memory
+ * stays bounded by the longest line. Names and values point into the current
+ * line and are only valid during the callback. Callbacks may be NULL,
+ * returning anything but MCFG_OK from a callback aborts parsing with that
+ * code.
+ *
+ * Import directives are only reported through on_import, the imported file
+ * is not followed.
+ *
+ * in_sector and section_type are maintained by the parser.
+ */
+typedef struct mcfg_stream {
+  char *path;
+  int line;
+  int column;
+  void *user;
+
+  int (*on_sector)(void *user, char *name, int len);
+  int (*on_section)(void *user, mcfg_stype type, char *name, int len);
+  int (*on_field)(void *user, mcfg_ftype type, char *name, int name_len,
+                  char *value, int value_len);
+  int (*on_line)(void *user, char *line, int len);
+  int (*on_import)(void *user, char *path, int len);
+
+  int in_sector;
+  mcfg_stype section_type;
+} mcfg_stream;
+
+/* Parses the file under the path in stream->path line by line, reporting its
+ * contents through the callbacks. Will return MCFG_OK if there were no
+ * errors, otherwise stream->line and stream->column hold the position of the
+ * error.
+ */
+int parse_stream(mcfg_stream *stream);
+
+/* Parses a single line of a stream, the stream has to be initialised with
+ * in_sector = 0 and section_type = ST_UNKNOWN before the first line.
+ */
+int parse_stream_line(mcfg_stream *stream, char *line);
+
 /* Navigation Functions */
 
 mcfg_sector *find_sector(struct mcfg_file *file, char *sector_name);
 mcfg_section *find_section(struct mcfg_file *file, char *path);
 mcfg_field *find_field(struct mcfg_file *file, char *path);
 
+/* Handle Functions */
+
+/* Looks up the sector ("sector"), section ("sector/section") or field
+ * ("sector/section/field") under the path like the navigation functions and
+ * stores a handle to it. Returns MCFG_ERR_UNKNOWN if nothing was found.
+ */
+int get_mcfg_handle(struct mcfg_file *file, char *path, mcfg_handle *handle);
+
+/* Resolves a handle to the record it refers to or to the sector or section
+ * containing it. Returns NULL if the handle is no longer valid or does not
+ * refer to a record of that level.
+ */
+mcfg_sector *handle_sector(mcfg_handle handle);
+mcfg_section *handle_section(mcfg_handle handle);
+mcfg_field *handle_field(mcfg_handle handle);
+
+/* Gives the file a new generation, invalidating all of its handles. Has to be
+ * called after records of a file have been moved or removed by hand.
+ */
+void invalidate_mcfg_handles(struct mcfg_file *file);
+
+/* Mutation Functions */
+/* NOTE: The mutation functions only change the sectors of the file itself,
+ *       never its imports. Like registering, they may move records, so
+ *       pointers into the file have to be renewed afterwards. Every mutation
+ *       makes an index over the file stale, start_query rebuilds it. Setting
+ *       and renaming keep handles valid, removing invalidates all handles of
+ *       the file. The hashes are kept up to date.
+ *       Files placed in a storage can not be changed, the functions fail with
+ *       MCFG_ERR_CAPACITY for them.
+ */
+
+/* Sets the type and value of the field under the path "sector/section/field".
+ *
+ * The field is added if the file has no such field, as are its sector and
+ * section (as a fields section) if they are missing. A field which only
+ * exists in an import is overridden by the new field.
+ *
+ * Returns:
+ *  MCFG_OK, MCFG_ERR_UNKNOWN if the path does not have three elements or
+ *  names a lines section or an allocation error.
+ */
+int set_field(struct mcfg_file *file, char *path, mcfg_ftype type,
+              char *value);
+
+/* Removes the field ("sector/section/field") or section ("sector/section")
+ * under the path. The order of the remaining records is kept.
+ *
+ * Returns:
+ *  MCFG_OK or MCFG_ERR_UNKNOWN if the file has no such field or section.
+ */
+int remove_field(struct mcfg_file *file, char *path);
+int remove_section(struct mcfg_file *file, char *path);
+
+/* Renames the sector ("sector"), section ("sector/section") or field
+ * ("sector/section/field") under the path.
+ *
+ * Returns:
+ *  MCFG_OK, MCFG_ERR_UNKNOWN if the file has no such record or
+ *  MCFG_PERR_DUPLICATE_SECTOR, _SECTION or _FIELD if the name is taken.
+ */
+int rename_mcfg_path(struct mcfg_file *file, char *path, char *name);
+
+/* Starts a transaction on the file. on_commit may be NULL.
+ *
+ * The txn_ functions work like the mutation functions above, but only the
+ * hashes of changed fields are updated right away. A failing change is undone
+ * on its own, the changes made before it stay in the transaction. Committing
+ * updates the remaining hashes once and calls on_commit once, which is the
+ * place to notify users of the file. Rolling back undoes all changes
+ * in reverse order.
+ *
+ * Notes:
+ *   - Handles are invalidated by removals even if they are rolled back and
+ *     by rolling back additions.
+ *   - The transaction can be reused after committing or rolling back, until
+ *     then the file must not be changed in any other way.
+ *
+ * Example:
+ *  mcfg_transaction txn;
+ *  begin_mcfg_transaction(&txn, file, notify_workers, &workers);
+ *  if (txn_set_field(&txn, "net/limits/rate", FT_STRING, "100") != MCFG_OK ||
+ *      txn_remove_field(&txn, "net/limits/burst") != MCFG_OK)
+ *    rollback_mcfg_transaction(&txn);
+ *  else
+ *    commit_mcfg_transaction(&txn);
+ */
+void begin_mcfg_transaction(mcfg_transaction *txn, struct mcfg_file *file,
+                            void (*on_commit)(void *user,
+                                              struct mcfg_file *file),
+                            void *user);
+int txn_set_field(mcfg_transaction *txn, char *path, mcfg_ftype type,
+                  char *value);
+int txn_remove_field(mcfg_transaction *txn, char *path);
+int txn_remove_section(mcfg_transaction *txn, char *path);
+int txn_rename(mcfg_transaction *txn, char *path, char *name);
+void commit_mcfg_transaction(mcfg_transaction *txn);
+void rollback_mcfg_transaction(mcfg_transaction *txn);
+
 /* Formats the contents of a list field.
  *
  * Parameters:
@@ -146,7 +579,8 @@ mcfg_field *find_field(struct mcfg_file *file, char *path);
  *
  * Returns:
  *   A dynamically allocated string with the formatted result.
- *   The caller is responsible for freeing the memory.
+ *   The caller is responsible for freeing the memory using
+ *   mcfg_free(file.allocator, result).
  *
  * Notes:
  *   - The list is inserted with space-seperation. Chars which come immediatly
@@ -189,7 +623,7 @@ char *format_list_field(struct mcfg_file file, mcfg_field field, char *context,
  *     it will not be replaced in the output string.
  *   - The resolved string is returned as a dynamically allocated string.
  *     The caller must free the memory allocated for the resolved string
- *     when it's no longer needed.
+ *     using mcfg_free(file.allocator, result) when it's no longer needed.
  */
 char *resolve_fields(struct mcfg_file file, char *in, char *context,
                      int leave_lists);
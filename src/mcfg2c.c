@@ -0,0 +1,606 @@
+/*
+ * mcfg2c.c ; author: Marie Eckert
+ *
+ * Embeds a mcfg file into a program as constant data.
+ *
+ * The generated header declares <name>, a pointer to the parsed file, and
+ * the lookup functions <name>_sector, <name>_section and <name>_field. Like
+ * with mcfg_gen, the implementation is emitted into the same header and
+ * enabled by defining <NAME>_IMPLEMENTATION in exactly one source file.
+ *
+ * All sectors, sections, fields and imported fragments are emitted as const
+ * initialized arrays, so using the file costs nothing at startup. The lookup
+ * functions use a perfect hash table over all paths which are found through
+ * find_sector, find_section and find_field, including those only found in
+ * imports.
+ *
+ * Usage: mcfg2c <file> <name> [output]
+ *
+ * <name> is used as is for the declared identifiers and therefore has to be a
+ * valid C identifier.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#include <mcfg.h>
+
+#include "gen_ident.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Average amount of paths per bucket of the displacement table */
+#define BUCKET_LOAD 4
+
+/* Displacements tried per bucket before the table is grown */
+#define MAX_DISPLACEMENT 65536
+
+/* A path of the lookup table and the records it refers to, given as indices
+ * into the emitted arrays. Unused levels are -1.
+ */
+typedef struct path_entry {
+  char *path;
+  uint64_t hash;
+  int file;
+  int sector;
+  int section;
+  int field;
+} path_entry;
+
+typedef struct generator {
+  FILE *out;
+  char *name;
+
+  int file_count;
+  mcfg_file **files;
+
+  int path_count;
+  int path_capacity;
+  path_entry *paths;
+
+  // Open addressed set of the indices of all paths, -1 marks free slots
+  int set_mask;
+  int *set;
+} generator;
+
+/* Has to match the hash function emitted by emit_lookup */
+static uint64_t hash_path(const char *path, uint64_t seed) {
+  uint64_t hash = 14695981039346656037ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+  for (; *path != 0; path++) {
+    hash ^= (unsigned char)*path;
+    hash *= 1099511628211ULL;
+  }
+
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+
+  return hash;
+}
+
+/* Emits a string literal, long strings are split at newlines. */
+static void emit_string(FILE *out, const char *str, size_t len) {
+  if (str == NULL) {
+    fprintf(out, "NULL");
+    return;
+  }
+
+  fputc('"', out);
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = str[i];
+    switch (c) {
+    case '\n':
+      fputs(i + 1 < len ? "\\n\"\n    \"" : "\\n", out);
+      break;
+    case '\t':
+      fputs("\\t", out);
+      break;
+    case '"':
+    case '\\':
+    case '?':
+      fprintf(out, "\\%c", c);
+      break;
+    default:
+      if (isprint(c))
+        fputc(c, out);
+      else
+        fprintf(out, "\\%03o", c);
+    }
+  }
+  fputc('"', out);
+}
+
+static const char *ftype_name(mcfg_ftype type) {
+  switch (type) {
+  case FT_STRING:
+    return "FT_STRING";
+  case FT_LIST:
+    return "FT_LIST";
+  default:
+    return "FT_UNKNOWN";
+  }
+}
+
+static const char *stype_name(mcfg_stype type) {
+  switch (type) {
+  case ST_FIELDS:
+    return "ST_FIELDS";
+  case ST_LINES:
+    return "ST_LINES";
+  default:
+    return "ST_UNKNOWN";
+  }
+}
+
+/* Collects the file and its imports depth first, every fragment once. */
+static void collect_files(generator *gen, mcfg_file *file) {
+  for (int i = 0; i < gen->file_count; i++)
+    if (gen->files[i] == file)
+      return;
+
+  gen->files = realloc(gen->files, (gen->file_count + 1) * sizeof(*gen->files));
+  gen->files[gen->file_count++] = file;
+
+  for (int i = 0; i < file->import_count; i++)
+    collect_files(gen, file->imports[i]);
+}
+
+static int file_id(generator *gen, mcfg_file *file) {
+  for (int i = 0; i < gen->file_count; i++)
+    if (gen->files[i] == file)
+      return i;
+
+  return -1;
+}
+
+static int *find_path(generator *gen, char *path, uint64_t hash) {
+  for (int i = hash & gen->set_mask;; i = (i + 1) & gen->set_mask)
+    if (gen->set[i] < 0 || strcmp(gen->paths[gen->set[i]].path, path) == 0)
+      return &gen->set[i];
+}
+
+static void add_path(generator *gen, char *path, int file, int sector,
+                     int section, int field) {
+  uint64_t hash = hash_path(path, 0);
+  if (gen->path_count == gen->path_capacity) {
+    gen->path_capacity = gen->path_capacity == 0 ? 64 : gen->path_capacity * 2;
+    gen->paths =
+        realloc(gen->paths, gen->path_capacity * sizeof(*gen->paths));
+
+    // The set is kept at most half full
+    gen->set_mask = gen->path_capacity * 2 - 1;
+    gen->set = realloc(gen->set, gen->path_capacity * 2 * sizeof(int));
+    memset(gen->set, -1, gen->path_capacity * 2 * sizeof(int));
+    for (int i = 0; i < gen->path_count; i++)
+      *find_path(gen, gen->paths[i].path, gen->paths[i].hash) = i;
+  }
+
+  int *slot = find_path(gen, path, hash);
+  if (*slot >= 0) {
+    free(path);
+    return;
+  }
+
+  *slot = gen->path_count;
+  gen->paths[gen->path_count++] =
+      (path_entry){path, hash, file, sector, section, field};
+}
+
+/* Adds the paths of the file before those of its imports, a path which was
+ * already added shadows the later ones like it does for the lookups.
+ */
+static void collect_paths(generator *gen, mcfg_file *file) {
+  int id = file_id(gen, file);
+
+  for (int i = 0; i < file->sector_count; i++) {
+    mcfg_sector *sector = &file->sectors[i];
+    add_path(gen, strdup(sector->name), id, i, -1, -1);
+
+    for (int j = 0; j < sector->section_count; j++) {
+      mcfg_section *section = &sector->sections[j];
+      char *path = malloc(strlen(sector->name) + strlen(section->name) + 2);
+      sprintf(path, "%s/%s", sector->name, section->name);
+      add_path(gen, path, id, i, j, -1);
+
+      for (int k = 0; k < section->field_count; k++) {
+        mcfg_field *field = &section->fields[k];
+        path = malloc(strlen(sector->name) + strlen(section->name) +
+                      strlen(field->name) + 3);
+        sprintf(path, "%s/%s/%s", sector->name, section->name, field->name);
+        add_path(gen, path, id, i, j, k);
+      }
+    }
+  }
+
+  for (int i = 0; i < file->import_count; i++)
+    collect_paths(gen, file->imports[i]);
+}
+
+/* Builds a hash and displace table: Every path falls into a bucket through
+ * its first hash, each bucket gets a seed for a second hash which places its
+ * paths into free slots. Returns the amount of slots (a power of two) or 0 if
+ * no seeds could be found.
+ */
+static int build_table(generator *gen, int bucket_count, int slot_count,
+                       int *slots, unsigned *seeds) {
+  int *order = malloc((bucket_count + 1) * sizeof(int));
+  int *sizes = calloc(bucket_count + 1, sizeof(int));
+  int *starts = malloc((bucket_count + 1) * sizeof(int));
+  int *members = malloc((gen->path_count + 1) * sizeof(int));
+
+  for (int i = 0; i < gen->path_count; i++)
+    sizes[gen->paths[i].hash % bucket_count]++;
+
+  // The paths of each bucket are stored contiguously in members
+  starts[0] = 0;
+  for (int i = 0; i < bucket_count; i++)
+    starts[i + 1] = starts[i] + sizes[i];
+  for (int i = 0; i < gen->path_count; i++)
+    members[starts[gen->paths[i].hash % bucket_count]++] = i;
+  for (int i = 0; i < bucket_count; i++)
+    starts[i] -= sizes[i];
+
+  // Larger buckets are placed first, while most slots are still free
+  for (int i = 0; i < bucket_count; i++) {
+    int j = i;
+    for (; j > 0 && sizes[order[j - 1]] < sizes[i]; j--)
+      order[j] = order[j - 1];
+    order[j] = i;
+  }
+
+  for (int i = 0; i < slot_count; i++)
+    slots[i] = -1;
+
+  int placed = 1;
+  for (int b = 0; b < bucket_count && placed; b++) {
+    int bucket = order[b];
+    int *bucket_members = members + starts[bucket];
+    int count = sizes[bucket];
+
+    seeds[bucket] = 0;
+    if (count == 0)
+      continue;
+
+    placed = 0;
+    for (unsigned seed = 1; seed < MAX_DISPLACEMENT && !placed; seed++) {
+      int k = 0;
+      for (; k < count; k++) {
+        int slot = hash_path(gen->paths[bucket_members[k]].path, seed) &
+                   (slot_count - 1);
+        if (slots[slot] != -1)
+          break;
+        slots[slot] = bucket_members[k];
+      }
+
+      if (k == count) {
+        seeds[bucket] = seed;
+        placed = 1;
+        break;
+      }
+
+      // Take back the paths placed with this seed
+      for (int i = 0; i < k; i++)
+        slots[hash_path(gen->paths[bucket_members[i]].path, seed) &
+              (slot_count - 1)] = -1;
+    }
+  }
+
+  free(members);
+  free(starts);
+  free(sizes);
+  free(order);
+
+  return placed ? slot_count : 0;
+}
+
+static void emit_fields(generator *gen, int id, int s, int x,
+                        mcfg_section *section) {
+  fprintf(gen->out, "static const mcfg_field %s_fields_%d_%d_%d[] = {\n",
+          gen->name, id, s, x);
+  for (int i = 0; i < section->field_count; i++) {
+    mcfg_field *field = &section->fields[i];
+    fprintf(gen->out, "    {%s, ", ftype_name(field->type));
+    emit_string(gen->out, field->name, strlen(field->name));
+    fprintf(gen->out, ", ");
+    emit_string(gen->out, field->value,
+                field->value == NULL ? 0 : strlen(field->value));
+    fprintf(gen->out, ", 0x%.16llxULL},\n", (unsigned long long)field->hash);
+  }
+  fprintf(gen->out, "};\n\n");
+}
+
+static void emit_sections(generator *gen, int id, int s, mcfg_sector *sector) {
+  for (int i = 0; i < sector->section_count; i++)
+    if (sector->sections[i].field_count > 0)
+      emit_fields(gen, id, s, i, &sector->sections[i]);
+
+  fprintf(gen->out, "static const mcfg_section %s_sections_%d_%d[] = {\n",
+          gen->name, id, s);
+  for (int i = 0; i < sector->section_count; i++) {
+    mcfg_section *section = &sector->sections[i];
+    fprintf(gen->out, "    {.type = %s,\n     .name = ",
+            stype_name(section->type));
+    emit_string(gen->out, section->name, strlen(section->name));
+    fprintf(gen->out, ",\n     .lines = ");
+    emit_string(gen->out, section->lines, section->lines_len);
+    fprintf(gen->out, ",\n     .lines_len = %zu,\n", section->lines_len);
+    fprintf(gen->out, "     .field_count = %d,\n", section->field_count);
+    if (section->field_count > 0)
+      fprintf(gen->out, "     .fields = (mcfg_field *)%s_fields_%d_%d_%d,\n",
+              gen->name, id, s, i);
+    fprintf(gen->out, "     .hash = 0x%.16llxULL},\n",
+            (unsigned long long)section->hash);
+  }
+  fprintf(gen->out, "};\n\n");
+}
+
+static void emit_file(generator *gen, int id) {
+  mcfg_file *file = gen->files[id];
+
+  for (int i = 0; i < file->sector_count; i++)
+    if (file->sectors[i].section_count > 0)
+      emit_sections(gen, id, i, &file->sectors[i]);
+
+  if (file->sector_count > 0) {
+    fprintf(gen->out, "static const mcfg_sector %s_sectors_%d[] = {\n",
+            gen->name, id);
+    for (int i = 0; i < file->sector_count; i++) {
+      mcfg_sector *sector = &file->sectors[i];
+      fprintf(gen->out, "    {.name = ");
+      emit_string(gen->out, sector->name, strlen(sector->name));
+      fprintf(gen->out, ",\n     .section_count = %d,\n",
+              sector->section_count);
+      if (sector->section_count > 0)
+        fprintf(gen->out,
+                "     .sections = (mcfg_section *)%s_sections_%d_%d,\n",
+                gen->name, id, i);
+      fprintf(gen->out, "     .hash = 0x%.16llxULL},\n",
+              (unsigned long long)sector->hash);
+    }
+    fprintf(gen->out, "};\n\n");
+  }
+
+  if (file->import_count > 0) {
+    fprintf(gen->out, "static mcfg_file *const %s_imports_%d[] = {\n",
+            gen->name, id);
+    for (int i = 0; i < file->import_count; i++)
+      fprintf(gen->out, "    (mcfg_file *)&%s_file_%d,\n", gen->name,
+              file_id(gen, file->imports[i]));
+    fprintf(gen->out, "};\n\n");
+  }
+
+  fprintf(gen->out, "static const mcfg_file %s_file_%d = {\n", gen->name, id);
+  fprintf(gen->out, "    .path = ");
+  emit_string(gen->out, file->path,
+              file->path == NULL ? 0 : strlen(file->path));
+  fprintf(gen->out, ",\n    .sector_count = %d,\n", file->sector_count);
+  if (file->sector_count > 0)
+    fprintf(gen->out, "    .sectors = (mcfg_sector *)%s_sectors_%d,\n",
+            gen->name, id);
+  fprintf(gen->out, "    .import_count = %d,\n", file->import_count);
+  if (file->import_count > 0)
+    fprintf(gen->out, "    .imports = (mcfg_file **)%s_imports_%d,\n",
+            gen->name, id);
+  fprintf(gen->out, "    .hash = 0x%.16llxULL};\n\n",
+          (unsigned long long)file->hash);
+}
+
+static void emit_entry_record(generator *gen, const char *kind,
+                              path_entry *entry, int level) {
+  if (level < 0) {
+    fprintf(gen->out, "NULL");
+    return;
+  }
+
+  fprintf(gen->out, "(mcfg_%s *)&%s_%ss_%d", kind, gen->name, kind,
+          entry->file);
+  if (entry->sector >= 0 && strcmp(kind, "sector") != 0)
+    fprintf(gen->out, "_%d", entry->sector);
+  if (entry->section >= 0 && strcmp(kind, "field") == 0)
+    fprintf(gen->out, "_%d", entry->section);
+  fprintf(gen->out, "[%d]", level);
+}
+
+static int emit_lookup(generator *gen) {
+  int bucket_count = gen->path_count / BUCKET_LOAD + 1;
+  int slot_count = 1;
+  while (slot_count < gen->path_count)
+    slot_count *= 2;
+
+  unsigned *seeds = malloc(bucket_count * sizeof(unsigned));
+  int *slots = NULL;
+  for (;;) {
+    slots = realloc(slots, slot_count * sizeof(int));
+    if (build_table(gen, bucket_count, slot_count, slots, seeds) != 0)
+      break;
+
+    slot_count *= 2;
+  }
+
+  fprintf(gen->out,
+          "typedef struct %s_entry {\n"
+          "  const char *path;\n"
+          "  mcfg_sector *sector;\n"
+          "  mcfg_section *section;\n"
+          "  mcfg_field *field;\n"
+          "} %s_entry;\n\n",
+          gen->name, gen->name);
+
+  fprintf(gen->out, "static const unsigned %s_seeds[%d] = {", gen->name,
+          bucket_count);
+  for (int i = 0; i < bucket_count; i++)
+    fprintf(gen->out, "%s%u,", i % 12 == 0 ? "\n    " : " ", seeds[i]);
+  fprintf(gen->out, "\n};\n\n");
+
+  fprintf(gen->out, "static const %s_entry %s_table[%d] = {\n", gen->name,
+          gen->name, slot_count);
+  if (gen->path_count == 0)
+    fprintf(gen->out, "    {NULL, NULL, NULL, NULL},\n");
+  for (int i = 0; i < slot_count; i++) {
+    if (slots[i] < 0)
+      continue;
+
+    path_entry *entry = &gen->paths[slots[i]];
+    fprintf(gen->out, "    [%d] = {", i);
+    emit_string(gen->out, entry->path, strlen(entry->path));
+    fprintf(gen->out, ",\n           ");
+    emit_entry_record(gen, "sector", entry, entry->sector);
+    fprintf(gen->out, ",\n           ");
+    emit_entry_record(gen, "section", entry, entry->section);
+    fprintf(gen->out, ",\n           ");
+    emit_entry_record(gen, "field", entry, entry->field);
+    fprintf(gen->out, "},\n");
+  }
+  fprintf(gen->out, "};\n\n");
+
+  fprintf(gen->out,
+          "static uint64_t %s_hash(const char *path, uint64_t seed) {\n"
+          "  uint64_t hash = 14695981039346656037ULL ^ "
+          "(seed * 0x9e3779b97f4a7c15ULL);\n"
+          "  for (; *path != 0; path++) {\n"
+          "    hash ^= (unsigned char)*path;\n"
+          "    hash *= 1099511628211ULL;\n"
+          "  }\n\n"
+          "  hash ^= hash >> 33;\n"
+          "  hash *= 0xff51afd7ed558ccdULL;\n"
+          "  hash ^= hash >> 33;\n\n"
+          "  return hash;\n"
+          "}\n\n",
+          gen->name);
+
+  fprintf(gen->out,
+          "static const %s_entry *%s_lookup(char *path) {\n"
+          "  if (path == NULL)\n"
+          "    return NULL;\n\n"
+          "  unsigned seed = %s_seeds[%s_hash(path, 0) %% %d];\n"
+          "  const %s_entry *entry = &%s_table[%s_hash(path, seed) & %d];\n"
+          "  if (entry->path == NULL || strcmp(entry->path, path) != 0)\n"
+          "    return NULL;\n\n"
+          "  return entry;\n"
+          "}\n\n",
+          gen->name, gen->name, gen->name, gen->name, bucket_count, gen->name,
+          gen->name, gen->name, slot_count - 1);
+
+  static const char *kinds[] = {"sector", "section", "field"};
+  for (int i = 0; i < 3; i++)
+    fprintf(gen->out,
+            "mcfg_%s *%s_%s(char *path) {\n"
+            "  const %s_entry *entry = %s_lookup(path);\n"
+            "  return entry == NULL || (%s) ? NULL : entry->%s;\n"
+            "}\n\n",
+            kinds[i], gen->name, kinds[i], gen->name, gen->name,
+            i == 0   ? "entry->section != NULL"
+            : i == 1 ? "entry->field != NULL"
+                     : "0",
+            kinds[i]);
+
+  free(slots);
+  free(seeds);
+
+  return slot_count;
+}
+
+static void emit_header(generator *gen, mcfg_file *file) {
+  char *guard = to_ident(gen->name);
+  for (char *c = guard; *c != 0; c++)
+    *c = toupper((unsigned char)*c);
+
+  fprintf(gen->out,
+          "/* %s.h ; generated by mcfg2c from %s\n"
+          " * Do not edit, regenerate the header from its mcfg file instead.\n"
+          " */\n\n",
+          gen->name, file->path);
+  fprintf(gen->out, "#ifndef %s_H\n#define %s_H\n\n", guard, guard);
+  fprintf(gen->out, "#include <mcfg.h>\n\n");
+  fprintf(gen->out,
+          "/* The contents of %s as constant data. It can be used with all\n"
+          " * functions which only read a file, but must not be changed or "
+          "freed.\n */\n",
+          file->path);
+  fprintf(gen->out, "extern mcfg_file *const %s;\n\n", gen->name);
+  fprintf(gen->out,
+          "/* Like find_sector, find_section and find_field on %s, but "
+          "through a\n"
+          " * perfect hash table built at compile time. The path has to "
+          "consist of\n"
+          " * exactly one, two or three elements respectively.\n */\n",
+          gen->name);
+  fprintf(gen->out, "mcfg_sector *%s_sector(char *path);\n", gen->name);
+  fprintf(gen->out, "mcfg_section *%s_section(char *path);\n", gen->name);
+  fprintf(gen->out, "mcfg_field *%s_field(char *path);\n\n", gen->name);
+  fprintf(gen->out, "#endif\n\n");
+
+  fprintf(gen->out, "#ifdef %s_IMPLEMENTATION\n\n", guard);
+  fprintf(gen->out, "#include <stdint.h>\n#include <string.h>\n\n");
+
+  // Imports may refer to each other in any order
+  for (int i = 0; i < gen->file_count; i++)
+    fprintf(gen->out, "static const mcfg_file %s_file_%d;\n", gen->name, i);
+  fprintf(gen->out, "\n");
+
+  for (int i = gen->file_count - 1; i >= 0; i--)
+    emit_file(gen, i);
+
+  fprintf(gen->out, "mcfg_file *const %s = (mcfg_file *)&%s_file_0;\n\n",
+          gen->name, gen->name);
+
+  emit_lookup(gen);
+  fprintf(gen->out, "#endif\n");
+
+  free(guard);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <file> <name> [output]\n", argv[0]);
+    return 1;
+  }
+
+  // The name is used as is for the declared identifiers
+  if (!is_c_name(argv[2])) {
+    fprintf(stderr, "%s: name '%s' is not a valid identifier\n", argv[0],
+            argv[2]);
+    return 1;
+  }
+
+  mcfg_file *file = calloc(1, sizeof(mcfg_file));
+  file->path = argv[1];
+  int ret = parse_file(file);
+  if (ret != MCFG_OK) {
+    fprintf(stderr, "%s:%d: parsing failed: 0x%.8x\n", file->path, file->line,
+            ret);
+    free_mcfg_file(file);
+    free_mcfg_import_cache();
+    return 1;
+  }
+
+  generator gen = {.out = stdout, .name = argv[2]};
+  collect_files(&gen, file);
+  collect_paths(&gen, file);
+
+  if (argc > 3 && (gen.out = fopen(argv[3], "w")) == NULL) {
+    perror(argv[3]);
+    ret = 1;
+    goto main_done;
+  }
+
+  emit_header(&gen, file);
+  if (gen.out != stdout)
+    fclose(gen.out);
+
+main_done:
+  for (int i = 0; i < gen.path_count; i++)
+    free(gen.paths[i].path);
+  free(gen.paths);
+  free(gen.set);
+  free(gen.files);
+  free_mcfg_file(file);
+  free_mcfg_import_cache();
+
+  return ret;
+}
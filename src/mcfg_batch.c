@@ -0,0 +1,404 @@
+/*
+ * mcfg_batch.c ; author: Marie Eckert
+ *
+ * Concurrent loading of multiple mcfg files.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#include <mcfg_batch.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#ifdef __NR_io_uring_setup
+#define HAVE_URING
+#endif
+#endif
+
+/******** file private ********/
+
+/* Thread pool */
+
+typedef struct pool_work {
+  mcfg_batch *batch;
+  atomic_int next;
+  int end;
+} pool_work;
+
+static void *pool_worker(void *arg) {
+  pool_work *work = arg;
+
+  int i;
+  while ((i = atomic_fetch_add(&work->next, 1)) < work->end)
+    work->batch->results[i] = parse_file(work->batch->files[i]);
+
+  return NULL;
+}
+
+/* Loads the files from start to the end of the batch on up to threads
+ * threads, the calling thread takes part in the work.
+ */
+static void load_pool(mcfg_batch *batch, int start, int threads) {
+  pool_work work = {.batch = batch, .end = batch->count};
+  atomic_init(&work.next, start);
+
+  if (threads > batch->count - start)
+    threads = batch->count - start;
+
+  pthread_t *workers = NULL;
+  int started = 0;
+  if (threads > 1)
+    workers = mcfg_malloc(NULL, (threads - 1) * sizeof(pthread_t));
+
+  for (; started < threads - 1; started++)
+    if (pthread_create(&workers[started], NULL, pool_worker, &work) != 0)
+      break;
+
+  pool_worker(&work);
+
+  for (int i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+
+  mcfg_free(NULL, workers);
+}
+
+#ifdef HAVE_URING
+
+/* io_uring through the raw system calls, so no liburing is required */
+
+#define RING_ENTRIES 64
+
+typedef struct uring {
+  int fd;
+  unsigned entries;
+
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ptr;
+  size_t sq_size;
+  void *cq_ptr;
+  size_t cq_size;
+  size_t sqes_size;
+} uring;
+
+/* State of a file whose read is in flight */
+typedef struct read_state {
+  int fd;
+  char *buffer;
+  size_t size;
+  size_t done;
+  struct iovec iov;
+} read_state;
+
+static int setup_uring(uring *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0)
+    return MCFG_ERR_MASK_ERRNO | errno;
+
+  ring->entries = params.sq_entries;
+  ring->sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && ring->cq_size > ring->sq_size)
+    ring->sq_size = ring->cq_size;
+
+  ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ptr == MAP_FAILED)
+    goto fail_sq;
+
+  ring->cq_ptr = ring->sq_ptr;
+  if (!single_mmap) {
+    ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd,
+                        IORING_OFF_CQ_RING);
+    if (ring->cq_ptr == MAP_FAILED)
+      goto fail_cq;
+  }
+
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    goto fail_sqes;
+
+  char *sq = ring->sq_ptr;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+  char *cq = ring->cq_ptr;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  return MCFG_OK;
+
+fail_sqes:
+  if (!single_mmap)
+    munmap(ring->cq_ptr, ring->cq_size);
+fail_cq:
+  munmap(ring->sq_ptr, ring->sq_size);
+fail_sq:;
+  int err = errno;
+  close(ring->fd);
+  return MCFG_ERR_MASK_ERRNO | err;
+}
+
+static void free_uring(uring *ring) {
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ptr != ring->sq_ptr)
+    munmap(ring->cq_ptr, ring->cq_size);
+  munmap(ring->sq_ptr, ring->sq_size);
+  close(ring->fd);
+}
+
+/* Queues a read of the rest of the file, the caller makes sure that there is
+ * a free submission entry.
+ */
+static void queue_read(uring *ring, read_state *state, int index) {
+  unsigned tail = *ring->sq_tail;
+  unsigned slot = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+  state->iov.iov_base = state->buffer + state->done;
+  state->iov.iov_len = state->size - state->done;
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_READV;
+  sqe->fd = state->fd;
+  sqe->off = state->done;
+  sqe->addr = (unsigned long)&state->iov;
+  sqe->len = 1;
+  sqe->user_data = index;
+
+  ring->sq_array[slot] = slot;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void finish_read(mcfg_batch *batch, read_state *state, int index) {
+  close(state->fd);
+  batch->results[index] =
+      parse_buffer(batch->files[index], state->buffer, state->done);
+  mcfg_free(NULL, state->buffer);
+  state->buffer = NULL;
+}
+
+/* Opens the file and queues its read. Returns 1 if a read was queued, empty
+ * and failing files are finished right away.
+ */
+static int start_read(uring *ring, mcfg_batch *batch, read_state *state,
+                      int index) {
+  // Only files with a buffer are in flight, see the cleanup in load_uring
+  state->buffer = NULL;
+  state->fd = open(batch->files[index]->path, O_RDONLY | O_CLOEXEC);
+  if (state->fd < 0) {
+    batch->results[index] = MCFG_ERR_MASK_ERRNO | errno;
+    state->fd = -1;
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(state->fd, &st) != 0) {
+    batch->results[index] = MCFG_ERR_MASK_ERRNO | errno;
+    close(state->fd);
+    state->fd = -1;
+    return 0;
+  }
+
+  state->size = st.st_size;
+  state->done = 0;
+  state->buffer = mcfg_malloc(NULL, state->size + 1);
+  if (state->buffer == NULL) {
+    batch->results[index] = MCFG_ERR_MASK_ERRNO | ENOMEM;
+    close(state->fd);
+    state->fd = -1;
+    return 0;
+  }
+
+  if (state->size == 0) {
+    finish_read(batch, state, index);
+    return 0;
+  }
+
+  queue_read(ring, state, index);
+  return 1;
+}
+
+/* Reads all files through the ring and parses each one as soon as its read
+ * has completed. Returns the index of the first file which has not been
+ * started if the ring fails.
+ */
+static int load_uring(uring *ring, mcfg_batch *batch) {
+  // Without the states nothing has been started, so the thread pool takes
+  // over all files
+  read_state *states = mcfg_malloc(NULL, batch->count * sizeof(read_state));
+  if (states == NULL)
+    return 0;
+  int next = 0;
+  unsigned in_flight = 0;
+  unsigned queued = 0;
+
+  for (;;) {
+    while (in_flight < ring->entries && next < batch->count) {
+      if (start_read(ring, batch, &states[next], next)) {
+        in_flight++;
+        queued++;
+      }
+      next++;
+    }
+
+    if (in_flight == 0)
+      break;
+
+    int ret = syscall(__NR_io_uring_enter, ring->fd, queued, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno == EINTR)
+      continue;
+
+    if (ret < 0) {
+      // Files which are still in flight fail, the others are left to the
+      // thread pool.
+      int err = MCFG_ERR_MASK_ERRNO | errno;
+      for (int i = 0; i < next; i++) {
+        if (states[i].buffer == NULL)
+          continue;
+
+        close(states[i].fd);
+        mcfg_free(NULL, states[i].buffer);
+        states[i].buffer = NULL;
+        batch->results[i] = err;
+      }
+      break;
+    }
+
+    // The kernel may take only part of the queue, the remaining entries stay
+    // in the ring and are submitted on the next call. It does not wait for
+    // completions in that case.
+    queued -= ret;
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      int index = cqe->user_data;
+      read_state *state = &states[index];
+
+      if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+        queue_read(ring, state, index);
+        queued++;
+        continue;
+      }
+
+      if (cqe->res < 0) {
+        close(state->fd);
+        mcfg_free(NULL, state->buffer);
+        state->buffer = NULL;
+        batch->results[index] = MCFG_ERR_MASK_ERRNO | -cqe->res;
+        in_flight--;
+        continue;
+      }
+
+      state->done += cqe->res;
+      if (cqe->res > 0 && state->done < state->size) {
+        queue_read(ring, state, index);
+        queued++;
+        continue;
+      }
+
+      // Either everything has been read or the file shrank in the meantime
+      finish_read(batch, state, index);
+      in_flight--;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  mcfg_free(NULL, states);
+  return next;
+}
+
+#endif // HAVE_URING
+
+/******** mcfg_batch.h ********/
+
+int load_mcfg_batch(mcfg_batch *batch, char **paths, int count, int threads,
+                    int flags) {
+  batch->count = count;
+  batch->files = mcfg_malloc(NULL, count * sizeof(mcfg_file *));
+  batch->results = mcfg_malloc(NULL, count * sizeof(int));
+  if (count > 0 && (batch->files == NULL || batch->results == NULL)) {
+    mcfg_free(NULL, batch->files);
+    mcfg_free(NULL, batch->results);
+    batch->count = 0;
+    return MCFG_ERR_MASK_ERRNO | ENOMEM;
+  }
+
+  for (int i = 0; i < count; i++) {
+    // Allocated with calloc, since free_mcfg_file frees the struct itself
+    // using free()
+    batch->files[i] = calloc(1, sizeof(mcfg_file));
+    batch->files[i]->path = paths[i];
+    batch->results[i] = MCFG_OK;
+  }
+
+  int start = 0;
+
+#ifdef HAVE_URING
+  uring ring;
+  if (!(flags & MCFG_BATCH_NO_URING) && count > 0 &&
+      setup_uring(&ring, count < RING_ENTRIES ? count : RING_ENTRIES) ==
+          MCFG_OK) {
+    start = load_uring(&ring, batch);
+    free_uring(&ring);
+  }
+#endif
+
+  if (start < count) {
+    if (threads <= 0)
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+    load_pool(batch, start, threads <= 0 ? 1 : threads);
+  }
+
+  return MCFG_OK;
+}
+
+void free_mcfg_batch(mcfg_batch *batch) {
+  for (int i = 0; i < batch->count; i++)
+    free_mcfg_file(batch->files[i]);
+
+  mcfg_free(NULL, batch->files);
+  mcfg_free(NULL, batch->results);
+  batch->count = 0;
+  batch->files = NULL;
+  batch->results = NULL;
+}
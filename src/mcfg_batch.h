@@ -0,0 +1,61 @@
+/*
+ * mcfg_batch.h ; author: Marie Eckert
+ *
+ * Concurrent loading of multiple mcfg files.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#ifndef MCFG_BATCH_H
+#define MCFG_BATCH_H
+
+#include <mcfg.h>
+
+/* Disables io_uring and always loads through the thread pool */
+#define MCFG_BATCH_NO_URING 0x00000001
+
+/* Result of a batch load.
+ *
+ * files[i] and results[i] belong to the i-th path passed to load_mcfg_batch.
+ * files[i]->path points to the path passed in and is not owned by the file.
+ * If results[i] is not MCFG_OK, files[i] holds whatever was parsed until the
+ * error occurred, its line and column hold the position of the error.
+ */
+typedef struct mcfg_batch {
+  int count;
+  mcfg_file **files;
+  int *results;
+} mcfg_batch;
+
+/* Loads all given files at once.
+ *
+ * On Linux the files are read through a single io_uring and parsed as their
+ * reads complete, so the reads of all files overlap. If io_uring is not
+ * available (or MCFG_BATCH_NO_URING is set), the files are loaded by parse_file
+ * on a pool of threads instead. Imports are resolved as usual.
+ *
+ * Parameters:
+ *   batch  : The batch to fill
+ *   paths  : The paths of the files to load
+ *   count  : The number of paths
+ *   threads: Size of the thread pool, 0 for the number of online CPUs
+ *   flags  : MCFG_BATCH_* flags
+ *
+ * Returns:
+ *   MCFG_OK if the batch was loaded, the results of the individual files are
+ *   stored in batch->results. Any other value means that the batch itself
+ *   could not be set up.
+ *
+ * Notes:
+ *   - When loading through the thread pool, the global allocator has to be
+ *     thread-safe, which the default allocator is.
+ */
+int load_mcfg_batch(mcfg_batch *batch, char **paths, int count, int threads,
+                    int flags);
+
+/* Frees all files of the batch and the batch arrays. */
+void free_mcfg_batch(mcfg_batch *batch);
+
+#endif
@@ -0,0 +1,595 @@
+/*
+ * mcfg_gen.c ; author: Marie Eckert
+ *
+ * Generates a C header with a typed struct and a binder for it from a mcfg
+ * schema.
+ *
+ * A schema is a regular mcfg file, every field in it describes an expected
+ * field of the same path. The value of a schema field consists of the C type
+ * and optionally the word "required":
+ *
+ *   sector .config
+ *     fields mariebuild:
+ *       str  compiler 'string required'
+ *       str  jobs     'int'
+ *       str  debug    'bool'
+ *       list files    'list required'
+ *
+ * The generated header declares the struct <name>, <name>_bind and
+ * <name>_free. The implementation is emitted into the same header and
+ * enabled by defining <NAME>_IMPLEMENTATION in exactly one source file.
+ *
+ * The binder works on a parsed mcfg_file instead of the callbacks of
+ * parse_stream: imported fragments are bound before the importing file so
+ * that its own values take precedence, and strings are not copied but point
+ * into the file. It still only takes a single pass over the fields.
+ *
+ * Names are turned into C identifiers by dropping leading characters which
+ * are not letters or digits and replacing all others by '_'. Names which map
+ * to the same identifier in the same struct, to no identifier at all or to a
+ * C keyword are reported as errors.
+ *
+ * Usage: mcfg_gen <schema> <name> [output]
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#include <mcfg.h>
+
+#include "gen_ident.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum gen_type { GT_STRING, GT_INT, GT_BOOL, GT_LIST } gen_type;
+
+static const char *type_names[] = {"string", "int", "bool", "list"};
+
+typedef struct gen_field {
+  char *path;
+  char *sector;
+  char *section;
+  char *name;
+  gen_type type;
+  int required;
+} gen_field;
+
+/* Emits str as a C string literal */
+static void emit_string(FILE *out, const char *str) {
+  fputc('"', out);
+  for (; *str != 0; str++) {
+    unsigned char c = *str;
+    switch (c) {
+    case '"':
+    case '\\':
+    case '?':
+      fprintf(out, "\\%c", c);
+      break;
+    default:
+      if (isprint(c))
+        fputc(c, out);
+      else
+        fprintf(out, "\\%03o", c);
+    }
+  }
+  fputc('"', out);
+}
+
+static int parse_schema_value(gen_field *field, mcfg_ftype ftype, char *value) {
+  char *copy = strdup(value);
+  char *word = strtok(copy, " ");
+  int ret = MCFG_OK;
+
+  field->required = 0;
+  if (word == NULL) {
+    ret = MCFG_PERR_INVALID_SYNTAX;
+    goto parse_schema_value_done;
+  }
+
+  field->type = GT_STRING;
+  while (field->type <= GT_LIST && strcmp(word, type_names[field->type]) != 0)
+    field->type++;
+
+  if (field->type > GT_LIST ||
+      ((field->type == GT_LIST) != (ftype == FT_LIST))) {
+    ret = MCFG_PERR_INVALID_FTYPE;
+    goto parse_schema_value_done;
+  }
+
+  while ((word = strtok(NULL, " ")) != NULL) {
+    if (strcmp(word, "required") != 0) {
+      ret = MCFG_PERR_INVALID_SYNTAX;
+      goto parse_schema_value_done;
+    }
+
+    field->required = 1;
+  }
+
+parse_schema_value_done:
+  free(copy);
+  return ret;
+}
+
+static int sector_field_count(mcfg_sector *sector) {
+  int count = 0;
+  for (int i = 0; i < sector->section_count; i++)
+    count += sector->sections[i].field_count;
+
+  return count;
+}
+
+/* Reports a name which can not be used as an identifier, or two names a and
+ * b which map to the same identifier. Returns the number of errors reported.
+ */
+static int check_names(char *path, char *a, char *b, char *kind) {
+  char *ident_a = to_ident(a);
+  char *ident_b = b == NULL ? NULL : to_ident(b);
+  int errors = 0;
+
+  if (b == NULL && invalid_ident(ident_a)) {
+    fprintf(stderr, "%s: %s name '%s' is not a valid identifier ('%s')\n",
+            path, kind, a, ident_a);
+    errors++;
+  } else if (b != NULL && strcmp(ident_a, ident_b) == 0) {
+    fprintf(stderr, "%s: %s names '%s' and '%s' both map to '%s'\n", path,
+            kind, a, b, ident_a);
+    errors++;
+  }
+
+  free(ident_b);
+  free(ident_a);
+  return errors;
+}
+
+/* Like check_names, but for a list field a which also declares a member
+ * <a>_count.
+ */
+static int check_count_name(char *path, char *a, char *b) {
+  char *ident_a = to_ident(a);
+  char *ident_b = to_ident(b);
+  int errors = 0;
+
+  size_t len = strlen(ident_a);
+  if (strncmp(ident_a, ident_b, len) == 0 &&
+      strcmp(ident_b + len, "_count") == 0) {
+    fprintf(stderr, "%s: field name '%s' maps to '%s', the count of list "
+            "'%s'\n", path, b, ident_b, a);
+    errors++;
+  }
+
+  free(ident_b);
+  free(ident_a);
+  return errors;
+}
+
+/* Checks that all members of the generated struct get distinct, valid
+ * identifiers. Sections and sectors without fields are not emitted and
+ * therefore not checked. Returns the number of errors reported.
+ */
+static int check_idents(mcfg_file *schema, gen_field *fields) {
+  int errors = 0;
+  int ix = 0;
+
+  for (int i = 0; i < schema->sector_count; i++) {
+    mcfg_sector *sector = &schema->sectors[i];
+    if (sector_field_count(sector) == 0)
+      continue;
+
+    errors += check_names(schema->path, sector->name, NULL, "sector");
+    for (int j = i + 1; j < schema->sector_count; j++)
+      if (sector_field_count(&schema->sectors[j]) > 0)
+        errors += check_names(schema->path, sector->name,
+                              schema->sectors[j].name, "sector");
+
+    for (int j = 0; j < sector->section_count; j++) {
+      mcfg_section *section = &sector->sections[j];
+      if (section->field_count == 0)
+        continue;
+
+      errors += check_names(schema->path, section->name, NULL, "section");
+      for (int k = j + 1; k < sector->section_count; k++)
+        if (sector->sections[k].field_count > 0)
+          errors += check_names(schema->path, section->name,
+                                sector->sections[k].name, "section");
+
+      for (int k = 0; k < section->field_count; k++) {
+        gen_field *field = &fields[ix + k];
+        errors += check_names(field->path, field->name, NULL, "field");
+
+        for (int l = 0; l < section->field_count; l++) {
+          if (l > k)
+            errors += check_names(schema->path, field->name,
+                                  fields[ix + l].name, "field");
+          if (l != k && field->type == GT_LIST)
+            errors += check_count_name(schema->path, field->name,
+                                       fields[ix + l].name);
+        }
+      }
+
+      ix += section->field_count;
+    }
+  }
+
+  return errors;
+}
+
+/* Sections and sectors without fields are left out, since empty structs are
+ * not allowed in C.
+ */
+static void emit_struct(FILE *out, mcfg_file *schema, gen_field *fields,
+                        char *name) {
+  fprintf(out, "typedef struct %s {\n", name);
+
+  int ix = 0;
+  for (int i = 0; i < schema->sector_count; i++) {
+    mcfg_sector *sector = &schema->sectors[i];
+    if (sector_field_count(sector) == 0)
+      continue;
+
+    char *sector_ident = to_ident(sector->name);
+    fprintf(out, "  struct {\n");
+
+    for (int j = 0; j < sector->section_count; j++) {
+      mcfg_section *section = &sector->sections[j];
+      if (section->field_count == 0)
+        continue;
+
+      char *section_ident = to_ident(section->name);
+      fprintf(out, "    struct {\n");
+
+      for (int k = 0; k < section->field_count; k++, ix++) {
+        char *ident = to_ident(fields[ix].name);
+        switch (fields[ix].type) {
+        case GT_STRING:
+          fprintf(out, "      char *%s;\n", ident);
+          break;
+        case GT_INT:
+          fprintf(out, "      long %s;\n", ident);
+          break;
+        case GT_BOOL:
+          fprintf(out, "      int %s;\n", ident);
+          break;
+        case GT_LIST:
+          fprintf(out, "      char **%s;\n", ident);
+          fprintf(out, "      int %s_count;\n", ident);
+          break;
+        }
+        free(ident);
+      }
+
+      fprintf(out, "    } %s;\n", section_ident);
+      free(section_ident);
+    }
+
+    fprintf(out, "  } %s;\n", sector_ident);
+    free(sector_ident);
+  }
+
+  fprintf(out, "} %s;\n\n", name);
+}
+
+static void emit_helpers(FILE *out, char *name) {
+  fprintf(out,
+          "static int %s_bind_int(char *value, long *out) {\n"
+          "  char *end;\n"
+          "  errno = 0;\n"
+          "  *out = strtol(value, &end, 0);\n"
+          "  return errno == 0 && end != value && *end == 0;\n"
+          "}\n\n",
+          name);
+
+  fprintf(out,
+          "static int %s_bind_bool(char *value, int *out) {\n"
+          "  if (strcmp(value, \"true\") == 0 ||\n"
+          "      strcmp(value, \"yes\") == 0 || strcmp(value, \"1\") == 0)\n"
+          "    return (*out = 1);\n"
+          "  *out = 0;\n"
+          "  return strcmp(value, \"false\") == 0 ||\n"
+          "         strcmp(value, \"no\") == 0 || strcmp(value, \"0\") == 0;\n"
+          "}\n\n",
+          name);
+
+  fprintf(out,
+          "static void %s_bind_list(char *value, char ***out, int *count) {\n"
+          "  free(*out);\n"
+          "  *count = 1;\n"
+          "  for (char *c = value; *c != 0; c++)\n"
+          "    if (*c == ':')\n"
+          "      (*count)++;\n\n"
+          "  // Elements and the copy of the value share one allocation\n"
+          "  *out = malloc(*count * sizeof(char *) + strlen(value) + 1);\n"
+          "  char *elem = (char *)(*out + *count);\n"
+          "  strcpy(elem, value);\n"
+          "  for (int i = 0; i < *count; i++) {\n"
+          "    (*out)[i] = elem;\n"
+          "    elem += strcspn(elem, \":\");\n"
+          "    *elem++ = 0;\n"
+          "  }\n"
+          "}\n\n",
+          name);
+}
+
+static void emit_field_bind(FILE *out, gen_field *field, int ix, char *name) {
+  char *sector_ident = to_ident(field->sector);
+  char *section_ident = to_ident(field->section);
+  char *ident = to_ident(field->name);
+
+  fprintf(out, "          if (strcmp(field->name, ");
+  emit_string(out, field->name);
+  fprintf(out, ") == 0) {\n");
+  fprintf(out, "            if (field->type != %s)\n",
+          field->type == GT_LIST ? "FT_LIST" : "FT_STRING");
+  fprintf(out, "              goto %s_bind_mistyped_%d;\n", name, ix);
+
+  char *member = malloc(strlen(sector_ident) + strlen(section_ident) +
+                        strlen(ident) + 8);
+  sprintf(member, "out->%s.%s.%s", sector_ident, section_ident, ident);
+
+  switch (field->type) {
+  case GT_STRING:
+    fprintf(out, "            %s = field->value;\n", member);
+    break;
+  case GT_INT:
+    fprintf(out, "            if (!%s_bind_int(field->value, &%s))\n", name,
+            member);
+    fprintf(out, "              goto %s_bind_mistyped_%d;\n", name, ix);
+    break;
+  case GT_BOOL:
+    fprintf(out, "            if (!%s_bind_bool(field->value, &%s))\n", name,
+            member);
+    fprintf(out, "              goto %s_bind_mistyped_%d;\n", name, ix);
+    break;
+  case GT_LIST:
+    fprintf(out, "            %s_bind_list(field->value, &%s, &%s_count);\n",
+            name, member, member);
+    break;
+  }
+
+  fprintf(out, "            seen[%d] = 1;\n", ix);
+  fprintf(out, "            continue;\n");
+  fprintf(out, "          }\n");
+
+  free(member);
+  free(ident);
+  free(section_ident);
+  free(sector_ident);
+}
+
+static void emit_binder(FILE *out, mcfg_file *schema, gen_field *fields,
+                        int field_count, char *name) {
+  fprintf(out,
+          "static int %s_bind_file(mcfg_file *file, %s *out, "
+          "unsigned char *seen,\n"
+          "                        char **error_path) {\n",
+          name, name);
+  fprintf(out, "  for (int i = file->import_count - 1; i >= 0; i--) {\n");
+  fprintf(out,
+          "    int ret = %s_bind_file(file->imports[i], out, seen, "
+          "error_path);\n",
+          name);
+  fprintf(out, "    if (ret != MCFG_OK)\n      return ret;\n  }\n\n");
+
+  fprintf(out, "  for (int i = 0; i < file->sector_count; i++) {\n");
+  fprintf(out, "    mcfg_sector *sector = &file->sectors[i];\n");
+
+  int ix = 0;
+  for (int i = 0; i < schema->sector_count; i++) {
+    mcfg_sector *sector = &schema->sectors[i];
+    if (sector_field_count(sector) == 0)
+      continue;
+
+    fprintf(out, "    if (strcmp(sector->name, ");
+    emit_string(out, sector->name);
+    fprintf(out, ") == 0) {\n");
+    fprintf(out, "      for (int j = 0; j < sector->section_count; j++) {\n");
+    fprintf(out, "        mcfg_section *section = &sector->sections[j];\n");
+
+    for (int j = 0; j < sector->section_count; j++) {
+      mcfg_section *section = &sector->sections[j];
+      if (section->field_count == 0)
+        continue;
+
+      fprintf(out, "        if (strcmp(section->name, ");
+      emit_string(out, section->name);
+      fprintf(out, ") == 0) {\n");
+      fprintf(out,
+              "          for (int k = 0; k < section->field_count; k++) {\n");
+      fprintf(out,
+              "            mcfg_field *field = &section->fields[k];\n");
+
+      for (int k = 0; k < section->field_count; k++, ix++)
+        emit_field_bind(out, &fields[ix], ix, name);
+
+      fprintf(out, "          }\n");
+      fprintf(out, "        }\n");
+    }
+
+    fprintf(out, "      }\n");
+    fprintf(out, "    }\n");
+  }
+  fprintf(out, "  }\n\n");
+  fprintf(out, "  return MCFG_OK;\n\n");
+
+  for (int i = 0; i < field_count; i++) {
+    fprintf(out, "%s_bind_mistyped_%d:\n", name, i);
+    fprintf(out, "  *error_path = ");
+    emit_string(out, fields[i].path);
+    fprintf(out, ";\n");
+    fprintf(out, "  return MCFG_PERR_INVALID_FTYPE;\n");
+  }
+  fprintf(out, "}\n\n");
+
+  fprintf(out,
+          "int %s_bind(mcfg_file *file, %s *out, char **error_path) {\n",
+          name, name);
+  fprintf(out, "  unsigned char seen[%d] = {0};\n", field_count + 1);
+  fprintf(out, "  memset(out, 0, sizeof(%s));\n\n", name);
+  fprintf(out,
+          "  int ret = %s_bind_file(file, out, seen, error_path);\n",
+          name);
+  fprintf(out, "  if (ret != MCFG_OK)\n    return ret;\n\n");
+
+  for (int i = 0; i < field_count; i++) {
+    if (!fields[i].required)
+      continue;
+
+    fprintf(out, "  if (!seen[%d]) {\n", i);
+    fprintf(out, "    *error_path = ");
+    emit_string(out, fields[i].path);
+    fprintf(out, ";\n");
+    fprintf(out, "    return MCFG_PERR_MISSING_REQUIRED;\n");
+    fprintf(out, "  }\n");
+  }
+  fprintf(out, "\n  return MCFG_OK;\n}\n\n");
+
+  fprintf(out, "void %s_free(%s *cfg) {\n", name, name);
+  for (int i = 0; i < field_count; i++) {
+    if (fields[i].type != GT_LIST)
+      continue;
+
+    char *sector_ident = to_ident(fields[i].sector);
+    char *section_ident = to_ident(fields[i].section);
+    char *ident = to_ident(fields[i].name);
+    fprintf(out, "  free(cfg->%s.%s.%s);\n", sector_ident, section_ident,
+            ident);
+    free(ident);
+    free(section_ident);
+    free(sector_ident);
+  }
+  fprintf(out, "}\n");
+}
+
+static void emit_header(FILE *out, mcfg_file *schema, gen_field *fields,
+                        int field_count, char *name) {
+  char *guard = to_ident(name);
+  for (char *c = guard; *c != 0; c++)
+    *c = toupper((unsigned char)*c);
+
+  fprintf(out,
+          "/* %s.h ; generated by mcfg_gen from %s\n"
+          " * Do not edit, regenerate the header from its schema instead.\n"
+          " */\n\n",
+          name, schema->path);
+  fprintf(out, "#ifndef %s_H\n#define %s_H\n\n", guard, guard);
+  fprintf(out, "#include <mcfg.h>\n\n");
+  fprintf(out, "/* Typed representation of the schema %s.\n", schema->path);
+  fprintf(out, " * Strings point into the bound mcfg_file, which has to "
+               "outlive the struct.\n */\n");
+  emit_struct(out, schema, fields, name);
+
+  fprintf(out,
+          "/* Fills out from the given file in a single pass over its "
+          "fields.\n"
+          " * Fields of imported fragments are bound first, so the values of "
+          "the file\n"
+          " * itself take precedence.\n"
+          " *\n"
+          " * Returns:\n"
+          " *  MCFG_OK, MCFG_PERR_MISSING_REQUIRED if a required field is "
+          "missing or\n"
+          " *  MCFG_PERR_INVALID_FTYPE if a field has the wrong type. "
+          "error_path is set\n"
+          " *  to the path of the offending field.\n"
+          " */\n");
+  fprintf(out, "int %s_bind(mcfg_file *file, %s *out, char **error_path);\n\n",
+          name, name);
+  fprintf(out,
+          "/* Frees the lists allocated by %s_bind, this also has to be "
+          "done if\n * binding failed.\n */\n",
+          name);
+  fprintf(out, "void %s_free(%s *cfg);\n\n", name, name);
+  fprintf(out, "#endif\n\n");
+
+  fprintf(out, "#ifdef %s_IMPLEMENTATION\n\n", guard);
+  fprintf(out, "#include <errno.h>\n#include <stdlib.h>\n#include "
+               "<string.h>\n\n");
+  emit_helpers(out, name);
+  emit_binder(out, schema, fields, field_count, name);
+  fprintf(out, "\n#endif\n");
+
+  free(guard);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <schema> <name> [output]\n", argv[0]);
+    return 1;
+  }
+
+  mcfg_file *schema = malloc(sizeof(mcfg_file));
+  schema->path = argv[1];
+  int ret = parse_file(schema);
+  if (ret != MCFG_OK) {
+    fprintf(stderr, "%s:%d: parsing failed: 0x%.8x\n", schema->path,
+            schema->line, ret);
+    free_mcfg_file(schema);
+    return 1;
+  }
+
+  int field_count = 0;
+  for (int i = 0; i < schema->sector_count; i++)
+    for (int j = 0; j < schema->sectors[i].section_count; j++)
+      field_count += schema->sectors[i].sections[j].field_count;
+
+  gen_field *fields = malloc((field_count + 1) * sizeof(gen_field));
+  int ix = 0;
+  for (int i = 0; i < schema->sector_count; i++) {
+    mcfg_sector *sector = &schema->sectors[i];
+    for (int j = 0; j < sector->section_count; j++) {
+      mcfg_section *section = &sector->sections[j];
+      for (int k = 0; k < section->field_count; k++, ix++) {
+        mcfg_field *field = &section->fields[k];
+        fields[ix].sector = sector->name;
+        fields[ix].section = section->name;
+        fields[ix].name = field->name;
+        fields[ix].path = malloc(strlen(sector->name) + strlen(section->name) +
+                                 strlen(field->name) + 3);
+        sprintf(fields[ix].path, "%s/%s/%s", sector->name, section->name,
+                field->name);
+
+        ret = parse_schema_value(&fields[ix], field->type, field->value);
+        if (ret != MCFG_OK) {
+          fprintf(stderr, "%s: invalid schema for %s: 0x%.8x\n", schema->path,
+                  fields[ix].path, ret);
+          field_count = ix + 1;
+          goto main_done;
+        }
+      }
+    }
+  }
+
+  if (!is_c_name(argv[2])) {
+    fprintf(stderr, "%s: name '%s' is not a valid identifier\n", argv[0],
+            argv[2]);
+    ret = 1;
+  } else if (check_idents(schema, fields) > 0) {
+    ret = 1;
+  }
+
+  if (ret != MCFG_OK)
+    goto main_done;
+
+  FILE *out = stdout;
+  if (argc > 3 && (out = fopen(argv[3], "w")) == NULL) {
+    perror(argv[3]);
+    ret = 1;
+    goto main_done;
+  }
+
+  emit_header(out, schema, fields, field_count, argv[2]);
+  if (out != stdout)
+    fclose(out);
+
+main_done:
+  for (int i = 0; i < field_count; i++)
+    free(fields[i].path);
+  free(fields);
+  free_mcfg_file(schema);
+  free_mcfg_import_cache();
+
+  return ret == MCFG_OK ? 0 : 1;
+}
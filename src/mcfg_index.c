@@ -0,0 +1,345 @@
+/*
+ * mcfg_index.c ; author: Marie Eckert
+ *
+ * Navigation index and wildcard path queries for mcfg files.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#include <mcfg_index.h>
+
+#include <errno.h>
+#include <string.h>
+
+/******** file private ********/
+
+#define QUERY_BY_FIELD 0
+#define QUERY_BY_SECTION 1
+#define QUERY_BY_SECTOR 2
+#define QUERY_SCAN 3
+
+// FNV-1a
+static unsigned long hash_name(const char *name, int len) {
+  unsigned long hash = 14695981039346656037UL;
+  for (int i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 1099511628211UL;
+  }
+
+  return hash;
+}
+
+static void insert_entry(int *buckets, int mask, mcfg_index_entry *entries,
+                         int ix) {
+  int bucket = entries[ix].hash & mask;
+  entries[ix].next = buckets[bucket];
+  buckets[bucket] = ix;
+}
+
+static int elem_matches(mcfg_pattern_elem *elem, const char *name) {
+  if (elem->is_prefix)
+    return strncmp(name, elem->start, elem->len) == 0;
+
+  return strncmp(name, elem->start, elem->len) == 0 && name[elem->len] == 0;
+}
+
+static int elem_is_literal(mcfg_pattern_elem *elem) {
+  return !elem->is_prefix;
+}
+
+/* Continues the query within the sector at section_ix and field_ix, both are
+ * reset once the sector has no further matches.
+ */
+static mcfg_field *next_in_sector(mcfg_query *query, mcfg_sector *sector) {
+  mcfg_pattern_elem *elems = query->elems;
+
+  for (; query->section_ix < sector->section_count; query->section_ix++) {
+    mcfg_section *section = &sector->sections[query->section_ix];
+    if (!elem_matches(&elems[1], section->name))
+      continue;
+
+    while (query->field_ix < section->field_count) {
+      mcfg_field *field = &section->fields[query->field_ix++];
+      if (!elem_matches(&elems[2], field->name))
+        continue;
+
+      query->sector = sector;
+      query->section = section;
+      query->field = field;
+      return field;
+    }
+
+    query->field_ix = 0;
+  }
+
+  query->section_ix = 0;
+  return NULL;
+}
+
+/******** mcfg_index.h ********/
+
+int build_mcfg_index(mcfg_index *index, mcfg_file *file) {
+  index->file = file;
+  index->revision = file->revision;
+  index->allocator =
+      file->allocator != NULL ? file->allocator : get_mcfg_allocator();
+  index->sector_count = file->sector_count;
+  index->section_count = 0;
+  index->field_count = 0;
+
+  for (int i = 0; i < file->sector_count; i++) {
+    mcfg_sector *sector = &file->sectors[i];
+    index->section_count += sector->section_count;
+    for (int j = 0; j < sector->section_count; j++)
+      index->field_count += sector->sections[j].field_count;
+  }
+
+  int bucket_count = 16;
+  while (bucket_count < index->field_count * 2 ||
+         bucket_count < index->section_count * 2 ||
+         bucket_count < index->sector_count * 2)
+    bucket_count *= 2;
+
+  index->bucket_mask = bucket_count - 1;
+  index->sector_buckets =
+      mcfg_malloc(index->allocator, bucket_count * sizeof(int));
+  index->section_buckets =
+      mcfg_malloc(index->allocator, bucket_count * sizeof(int));
+  index->field_buckets =
+      mcfg_malloc(index->allocator, bucket_count * sizeof(int));
+  index->sectors = mcfg_malloc(
+      index->allocator, (index->sector_count + 1) * sizeof(mcfg_index_entry));
+  index->sections = mcfg_malloc(
+      index->allocator, (index->section_count + 1) * sizeof(mcfg_index_entry));
+  index->fields = mcfg_malloc(
+      index->allocator, (index->field_count + 1) * sizeof(mcfg_index_entry));
+
+  if (index->sector_buckets == NULL || index->section_buckets == NULL ||
+      index->field_buckets == NULL || index->sectors == NULL ||
+      index->sections == NULL || index->fields == NULL) {
+    free_mcfg_index(index);
+    // Keep the index stale so the next query attempts the rebuild again
+    index->revision = file->revision - 1;
+    return MCFG_ERR_MASK_ERRNO | ENOMEM;
+  }
+
+  memset(index->sector_buckets, -1, bucket_count * sizeof(int));
+  memset(index->section_buckets, -1, bucket_count * sizeof(int));
+  memset(index->field_buckets, -1, bucket_count * sizeof(int));
+
+  int section_ix = 0;
+  int field_ix = 0;
+  for (int i = 0; i < file->sector_count; i++) {
+    mcfg_sector *sector = &file->sectors[i];
+
+    mcfg_index_entry *entry = &index->sectors[i];
+    entry->hash = hash_name(sector->name, strlen(sector->name));
+    entry->sector = sector;
+    entry->section = NULL;
+    entry->field = NULL;
+    insert_entry(index->sector_buckets, index->bucket_mask, index->sectors, i);
+
+    for (int j = 0; j < sector->section_count; j++) {
+      mcfg_section *section = &sector->sections[j];
+
+      entry = &index->sections[section_ix];
+      entry->hash = hash_name(section->name, strlen(section->name));
+      entry->sector = sector;
+      entry->section = section;
+      entry->field = NULL;
+      insert_entry(index->section_buckets, index->bucket_mask, index->sections,
+                   section_ix);
+      section_ix++;
+
+      for (int k = 0; k < section->field_count; k++) {
+        mcfg_field *field = &section->fields[k];
+
+        entry = &index->fields[field_ix];
+        entry->hash = hash_name(field->name, strlen(field->name));
+        entry->sector = sector;
+        entry->section = section;
+        entry->field = field;
+        insert_entry(index->field_buckets, index->bucket_mask, index->fields,
+                     field_ix);
+        field_ix++;
+      }
+    }
+  }
+
+  return MCFG_OK;
+}
+
+void free_mcfg_index(mcfg_index *index) {
+  mcfg_free(index->allocator, index->sector_buckets);
+  mcfg_free(index->allocator, index->section_buckets);
+  mcfg_free(index->allocator, index->field_buckets);
+  mcfg_free(index->allocator, index->sectors);
+  mcfg_free(index->allocator, index->sections);
+  mcfg_free(index->allocator, index->fields);
+
+  index->sector_buckets = NULL;
+  index->section_buckets = NULL;
+  index->field_buckets = NULL;
+  index->sectors = NULL;
+  index->sections = NULL;
+  index->fields = NULL;
+  index->sector_count = 0;
+  index->section_count = 0;
+  index->field_count = 0;
+}
+
+int rebuild_mcfg_index(mcfg_index *index) {
+  free_mcfg_index(index);
+  return build_mcfg_index(index, index->file);
+}
+
+int start_query(mcfg_query *query, mcfg_index *index, char *pattern) {
+  if (pattern == NULL)
+    return MCFG_ERR_INVALID_PATTERN;
+
+  if (index->revision != index->file->revision) {
+    int result = rebuild_mcfg_index(index);
+    if (result != MCFG_OK)
+      return result;
+  }
+
+  query->index = index;
+  query->sector = NULL;
+  query->section = NULL;
+  query->field = NULL;
+
+  char *start = pattern;
+  for (int i = 0; i < 3; i++) {
+    char *end = strchr(start, '/');
+    if ((end == NULL) != (i == 2))
+      return MCFG_ERR_INVALID_PATTERN;
+    if (end == NULL)
+      end = start + strlen(start);
+
+    mcfg_pattern_elem *elem = &query->elems[i];
+    elem->start = start;
+    elem->len = end - start;
+    elem->is_prefix = elem->len > 0 && start[elem->len - 1] == '*';
+    if (elem->is_prefix)
+      elem->len--;
+
+    start = end + 1;
+  }
+
+  mcfg_pattern_elem *elem;
+  if (elem_is_literal(&query->elems[2])) {
+    query->strategy = QUERY_BY_FIELD;
+    elem = &query->elems[2];
+    query->cursor = index->field_buckets[hash_name(elem->start, elem->len) &
+                                         index->bucket_mask];
+  } else if (elem_is_literal(&query->elems[1])) {
+    query->strategy = QUERY_BY_SECTION;
+    elem = &query->elems[1];
+    query->cursor = index->section_buckets[hash_name(elem->start, elem->len) &
+                                           index->bucket_mask];
+    query->field_ix = 0;
+  } else if (elem_is_literal(&query->elems[0])) {
+    query->strategy = QUERY_BY_SECTOR;
+    elem = &query->elems[0];
+    query->cursor = index->sector_buckets[hash_name(elem->start, elem->len) &
+                                          index->bucket_mask];
+    query->section_ix = 0;
+    query->field_ix = 0;
+  } else {
+    query->strategy = QUERY_SCAN;
+    query->sector_ix = 0;
+    query->section_ix = 0;
+    query->field_ix = 0;
+  }
+
+  return MCFG_OK;
+}
+
+mcfg_field *next_query_result(mcfg_query *query) {
+  mcfg_index *index = query->index;
+  mcfg_pattern_elem *elems = query->elems;
+  mcfg_index_entry *entry;
+
+  // The entries may point to records which were moved or freed
+  if (index->revision != index->file->revision) {
+    query->sector = NULL;
+    query->section = NULL;
+    query->field = NULL;
+    return NULL;
+  }
+
+  switch (query->strategy) {
+  case QUERY_BY_FIELD:
+    while (query->cursor != -1) {
+      entry = &index->fields[query->cursor];
+      query->cursor = entry->next;
+
+      if (!elem_matches(&elems[2], entry->field->name) ||
+          !elem_matches(&elems[1], entry->section->name) ||
+          !elem_matches(&elems[0], entry->sector->name))
+        continue;
+
+      query->sector = entry->sector;
+      query->section = entry->section;
+      query->field = entry->field;
+      return query->field;
+    }
+    break;
+  case QUERY_BY_SECTION:
+    while (query->cursor != -1) {
+      entry = &index->sections[query->cursor];
+
+      if (query->field_ix == 0 &&
+          (!elem_matches(&elems[1], entry->section->name) ||
+           !elem_matches(&elems[0], entry->sector->name))) {
+        query->cursor = entry->next;
+        continue;
+      }
+
+      while (query->field_ix < entry->section->field_count) {
+        mcfg_field *field = &entry->section->fields[query->field_ix++];
+        if (!elem_matches(&elems[2], field->name))
+          continue;
+
+        query->sector = entry->sector;
+        query->section = entry->section;
+        query->field = field;
+        return field;
+      }
+
+      query->cursor = entry->next;
+      query->field_ix = 0;
+    }
+    break;
+  case QUERY_BY_SECTOR:
+    while (query->cursor != -1) {
+      entry = &index->sectors[query->cursor];
+      if (elem_matches(&elems[0], entry->sector->name)) {
+        mcfg_field *field = next_in_sector(query, entry->sector);
+        if (field != NULL)
+          return field;
+      }
+
+      query->cursor = entry->next;
+    }
+    break;
+  case QUERY_SCAN:
+    for (; query->sector_ix < index->file->sector_count; query->sector_ix++) {
+      mcfg_sector *sector = &index->file->sectors[query->sector_ix];
+      if (!elem_matches(&elems[0], sector->name))
+        continue;
+
+      mcfg_field *field = next_in_sector(query, sector);
+      if (field != NULL)
+        return field;
+    }
+    break;
+  }
+
+  query->sector = NULL;
+  query->section = NULL;
+  query->field = NULL;
+  return NULL;
+}
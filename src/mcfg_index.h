@@ -0,0 +1,138 @@
+/*
+ * mcfg_index.h ; author: Marie Eckert
+ *
+ * Navigation index and wildcard path queries for mcfg files.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#ifndef MCFG_INDEX_H
+#define MCFG_INDEX_H
+
+#include <mcfg.h>
+
+/* A single indexed sector, section or field. Entries with the same bucket are
+ * chained through next, -1 terminates a chain.
+ */
+typedef struct mcfg_index_entry {
+  unsigned long hash;
+  mcfg_sector *sector;
+  mcfg_section *section;
+  mcfg_field *field;
+  int next;
+} mcfg_index_entry;
+
+/* Hash tables over the sector, section and field names of a mcfg file.
+ *
+ * revision is the revision of the file the index was built for. Changes made
+ * through the mutation functions of mcfg.h are detected through it, queries
+ * on a stale index rebuild it first.
+ *
+ * NOTE: Like pointers into the file, the index has to be rebuilt after using
+ *       any of the registering functions on the indexed file, since they do
+ *       not change the revision.
+ */
+typedef struct mcfg_index {
+  mcfg_file *file;
+  unsigned long revision;
+  mcfg_allocator *allocator;
+  int bucket_mask;
+  int *sector_buckets;
+  int *section_buckets;
+  int *field_buckets;
+  int sector_count;
+  mcfg_index_entry *sectors;
+  int section_count;
+  mcfg_index_entry *sections;
+  int field_count;
+  mcfg_index_entry *fields;
+} mcfg_index;
+
+/* One component of a query pattern, points into the pattern string.
+ */
+typedef struct mcfg_pattern_elem {
+  char *start;
+  int len;
+  int is_prefix;
+} mcfg_pattern_elem;
+
+/* State of a running query, the current match is stored in sector, section
+ * and field.
+ */
+typedef struct mcfg_query {
+  mcfg_index *index;
+  mcfg_pattern_elem elems[3];
+  int strategy;
+  int cursor;
+  int sector_ix;
+  int section_ix;
+  int field_ix;
+
+  mcfg_sector *sector;
+  mcfg_section *section;
+  mcfg_field *field;
+} mcfg_query;
+
+/* Builds the navigation index for the given file.
+ *
+ * Returns:
+ *  One of the declared MCFG return codes; MCFG_OK if everything was successful
+ *  or ENOMEM masked with MCFG_ERR_MASK_ERRNO if an allocation failed, in which
+ *  case the index is left empty and stale.
+ *
+ * Notes:
+ *   - Only the sectors of the file itself are indexed, to query a file
+ *     together with its imports build the index over an overlay of them.
+ */
+int build_mcfg_index(mcfg_index *index, mcfg_file *file);
+
+/* Builds the index again for the file it was built for. This happens
+ * automatically when a query is started after the file was changed.
+ */
+int rebuild_mcfg_index(mcfg_index *index);
+
+/* Frees all memory held by the index.
+ */
+void free_mcfg_index(mcfg_index *index);
+
+/* Starts a query for all fields matching the given pattern.
+ *
+ * Parameters:
+ *   query  : The query state to be initialised
+ *   index  : The index of the file to be queried
+ *   pattern: A path of the form sector/section/field. Each component may
+ *          | be "*" to match any name or end in "*" to match every name
+ *          | starting with the preceding characters.
+ *
+ * Returns:
+ *  MCFG_OK, MCFG_ERR_INVALID_PATTERN if the pattern does not consist of
+ *  exactly three components or the error of rebuilding a stale index.
+ *
+ * Notes:
+ *   - The pattern is not copied and has to stay valid until the query is
+ *     finished.
+ *   - If the field component contains no wildcard, only the fields of that
+ *     name are visited. Otherwise only the sections of a literal section
+ *     component are visited, or if that has a wildcard as well, only the
+ *     sector of a literal sector component. Patterns without any literal
+ *     component visit every field.
+ *
+ * Example:
+ *  mcfg_query query;
+ *  start_query(&query, &index, ".config/mariebuild/comp*");
+ *  while (next_query_result(&query) != NULL)
+ *    printf("%s = %s\n", query.field->name, query.field->value);
+ */
+int start_query(mcfg_query *query, mcfg_index *index, char *pattern);
+
+/* Advances the query to the next matching field.
+ *
+ * Returns:
+ *   The next matching field or NULL if there are no more matches or the file
+ *   was changed since the query was started.
+ */
+mcfg_field *next_query_result(mcfg_query *query);
+
+#endif
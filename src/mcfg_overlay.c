@@ -0,0 +1,152 @@
+/*
+ * mcfg_overlay.c ; author: Marie Eckert
+ *
+ * Layered overlays of multiple mcfg files.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#include <mcfg_overlay.h>
+
+#include <string.h>
+
+/******** file private ********/
+
+static mcfg_sector *merge_sector(mcfg_file *merged, mcfg_sector *src) {
+  for (int i = 0; i < merged->sector_count; i++)
+    if (strcmp(merged->sectors[i].name, src->name) == 0)
+      return &merged->sectors[i];
+
+  merged->sector_count++;
+  merged->sectors = mcfg_realloc(merged->allocator, merged->sectors,
+                                 merged->sector_count * sizeof(mcfg_sector));
+
+  mcfg_sector *sector = &merged->sectors[merged->sector_count - 1];
+  sector->name = src->name;
+  sector->section_count = 0;
+  sector->sections = NULL;
+  sector->allocator = merged->allocator;
+
+  return sector;
+}
+
+static void reset_section(mcfg_section *section, mcfg_section *src) {
+  mcfg_free(section->allocator, section->fields);
+  section->type = src->type;
+  section->name = src->name;
+  section->section_type = src->section_type;
+  section->lines = src->lines;
+  section->lines_len = src->lines_len;
+  section->field_count = 0;
+  section->fields = NULL;
+}
+
+static mcfg_section *merge_section(mcfg_sector *sector, mcfg_section *src) {
+  for (int i = 0; i < sector->section_count; i++) {
+    mcfg_section *section = &sector->sections[i];
+    if (strcmp(section->name, src->name) != 0)
+      continue;
+
+    if (section->type != src->type || src->type == ST_LINES)
+      reset_section(section, src);
+
+    return section;
+  }
+
+  sector->section_count++;
+  sector->sections = mcfg_realloc(sector->allocator, sector->sections,
+                                  sector->section_count * sizeof(mcfg_section));
+
+  mcfg_section *section = &sector->sections[sector->section_count - 1];
+  section->fields = NULL;
+  section->allocator = sector->allocator;
+  reset_section(section, src);
+
+  return section;
+}
+
+static void merge_field(mcfg_section *section, mcfg_field *src) {
+  for (int i = 0; i < section->field_count; i++) {
+    if (strcmp(section->fields[i].name, src->name) == 0) {
+      section->fields[i] = *src;
+      return;
+    }
+  }
+
+  section->field_count++;
+  section->fields = mcfg_realloc(section->allocator, section->fields,
+                                 section->field_count * sizeof(mcfg_field));
+  section->fields[section->field_count - 1] = *src;
+}
+
+static void merge_layer(mcfg_file *merged, mcfg_file *layer) {
+  // The first import takes precedence over later ones, so they have to be
+  // merged in reverse.
+  for (int i = layer->import_count - 1; i >= 0; i--)
+    merge_layer(merged, layer->imports[i]);
+
+  for (int i = 0; i < layer->sector_count; i++) {
+    mcfg_sector *src_sector = &layer->sectors[i];
+    mcfg_sector *sector = merge_sector(merged, src_sector);
+
+    for (int j = 0; j < src_sector->section_count; j++) {
+      mcfg_section *src_section = &src_sector->sections[j];
+      mcfg_section *section = merge_section(sector, src_section);
+
+      for (int k = 0; k < src_section->field_count; k++)
+        merge_field(section, &src_section->fields[k]);
+    }
+  }
+}
+
+/******** mcfg_overlay.h ********/
+
+int build_mcfg_overlay(mcfg_overlay *overlay, mcfg_file **layers,
+                       int layer_count) {
+  if (layers == NULL || layer_count < 1)
+    return MCFG_ERR_UNKNOWN;
+
+  mcfg_allocator *allocator = get_mcfg_allocator();
+  overlay->layer_count = layer_count;
+  overlay->layers = mcfg_malloc(allocator, layer_count * sizeof(mcfg_file *));
+  memcpy(overlay->layers, layers, layer_count * sizeof(mcfg_file *));
+
+  overlay->merged.path = NULL;
+  overlay->merged.line = 0;
+  overlay->merged.sector_count = 0;
+  overlay->merged.sectors = NULL;
+  overlay->merged.import_count = 0;
+  overlay->merged.imports = NULL;
+  overlay->merged.import_paths = NULL;
+  overlay->merged.allocator = allocator;
+
+  for (int i = 0; i < layer_count; i++)
+    merge_layer(&overlay->merged, layers[i]);
+
+  update_mcfg_hashes(&overlay->merged);
+  invalidate_mcfg_handles(&overlay->merged);
+
+  return MCFG_OK;
+}
+
+void free_mcfg_overlay(mcfg_overlay *overlay) {
+  mcfg_allocator *allocator = overlay->merged.allocator;
+
+  for (int i = 0; i < overlay->merged.sector_count; i++) {
+    mcfg_sector *sector = &overlay->merged.sectors[i];
+    for (int j = 0; j < sector->section_count; j++)
+      mcfg_free(allocator, sector->sections[j].fields);
+
+    mcfg_free(allocator, sector->sections);
+  }
+
+  mcfg_free(allocator, overlay->merged.sectors);
+  mcfg_free(allocator, overlay->layers);
+
+  overlay->merged.sector_count = 0;
+  overlay->merged.sectors = NULL;
+  overlay->layer_count = 0;
+  overlay->layers = NULL;
+}
@@ -0,0 +1,54 @@
+/*
+ * mcfg_overlay.h ; author: Marie Eckert
+ *
+ * Layered overlays of multiple mcfg files.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#ifndef MCFG_OVERLAY_H
+#define MCFG_OVERLAY_H
+
+#include <mcfg.h>
+
+/* A stack of parsed mcfg files merged into a single flattened file.
+ *
+ * merged can be used with all navigation functions and resolve_fields like
+ * any other parsed file. It does not own any names or values, these are
+ * borrowed from the layers, which therefore have to outlive the overlay.
+ */
+typedef struct mcfg_overlay {
+  int layer_count;
+  mcfg_file **layers;
+  mcfg_file merged;
+} mcfg_overlay;
+
+/* Builds the flattened view of the given layers.
+ *
+ * Parameters:
+ *   overlay    : The overlay to be built
+ *   layers     : The files to be stacked, layers[0] has the lowest precedence
+ *   layer_count: The amount of layers
+ *
+ * Returns:
+ *  One of the declared MCFG return codes; MCFG_OK if everything was successful
+ *
+ * Notes:
+ *   - Sectors and sections of all layers are merged by name, fields of a
+ *     higher layer replace fields of the same name from lower layers.
+ *   - If a section changes its type or is a lines section, the section of the
+ *     higher layer replaces the lower one as a whole.
+ *   - Imports of a layer are merged in with a lower precedence than the layer
+ *     itself.
+ *   - The overlay has to be rebuilt if any of the layers are modified.
+ */
+int build_mcfg_overlay(mcfg_overlay *overlay, mcfg_file **layers,
+                       int layer_count);
+
+/* Frees the flattened view of the overlay, the layers are left untouched.
+ */
+void free_mcfg_overlay(mcfg_overlay *overlay);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * mcfg_pool.c ; author: Marie Eckert
+ *
+ * Pool allocator for the small records and strings of mcfg files.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#include <mcfg_pool.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/******** file private ********/
+
+#define CHUNK_SIZE (64 * 1024)
+#define CLASS_COUNT 8
+#define LARGE_CLASS CLASS_COUNT
+
+static const size_t class_sizes[CLASS_COUNT] = {16, 24, 32, 48,
+                                                64, 96, 128, 256};
+
+/* Every block is preceded by its size class, large blocks additionally by
+ * their list links so they can be released together with the pool.
+ */
+typedef struct block_header {
+  size_t size_class;
+} block_header;
+
+typedef struct large_header {
+  struct large_header *prev;
+  struct large_header *next;
+  size_t size;
+  block_header header;
+} large_header;
+
+typedef struct free_block {
+  struct free_block *next;
+} free_block;
+
+typedef struct chunk {
+  struct chunk *next;
+  size_t used;
+  size_t pad;
+} chunk;
+
+typedef struct pool {
+  mcfg_allocator allocator;
+  free_block *free_lists[CLASS_COUNT];
+  chunk *chunks;
+  large_header *large;
+} pool;
+
+static int size_class(size_t size) {
+  for (int i = 0; i < CLASS_COUNT; i++)
+    if (size <= class_sizes[i])
+      return i;
+
+  return LARGE_CLASS;
+}
+
+static void *pool_malloc_large(pool *p, size_t size) {
+  large_header *large = malloc(sizeof(large_header) + size);
+  if (large == NULL)
+    return NULL;
+
+  large->prev = NULL;
+  large->next = p->large;
+  large->size = size;
+  large->header.size_class = LARGE_CLASS;
+  if (p->large != NULL)
+    p->large->prev = large;
+  p->large = large;
+
+  return large + 1;
+}
+
+static void *pool_malloc(void *ctx, size_t size) {
+  pool *p = ctx;
+  int class = size_class(size);
+
+  if (class == LARGE_CLASS)
+    return pool_malloc_large(p, size);
+
+  block_header *header;
+  if (p->free_lists[class] != NULL) {
+    header = (block_header *)p->free_lists[class] - 1;
+    p->free_lists[class] = p->free_lists[class]->next;
+    return header + 1;
+  }
+
+  size_t block_size = sizeof(block_header) + class_sizes[class];
+  if (p->chunks == NULL || p->chunks->used + block_size > CHUNK_SIZE) {
+    chunk *c = malloc(CHUNK_SIZE);
+    if (c == NULL)
+      return NULL;
+
+    c->next = p->chunks;
+    c->used = sizeof(chunk);
+    p->chunks = c;
+  }
+
+  header = (block_header *)((char *)p->chunks + p->chunks->used);
+  header->size_class = class;
+  p->chunks->used += block_size;
+
+  return header + 1;
+}
+
+static void pool_free(void *ctx, void *ptr) {
+  pool *p = ctx;
+  block_header *header = (block_header *)ptr - 1;
+
+  if (header->size_class == LARGE_CLASS) {
+    large_header *large = (large_header *)ptr - 1;
+    if (large->prev != NULL)
+      large->prev->next = large->next;
+    else
+      p->large = large->next;
+    if (large->next != NULL)
+      large->next->prev = large->prev;
+
+    free(large);
+    return;
+  }
+
+  free_block *block = ptr;
+  block->next = p->free_lists[header->size_class];
+  p->free_lists[header->size_class] = block;
+}
+
+static void *pool_realloc(void *ctx, void *ptr, size_t size) {
+  pool *p = ctx;
+  block_header *header = (block_header *)ptr - 1;
+  size_t old_size;
+
+  if (header->size_class == LARGE_CLASS) {
+    large_header *large = (large_header *)ptr - 1;
+    if (size_class(size) == LARGE_CLASS) {
+      large_header *moved = realloc(large, sizeof(large_header) + size);
+      if (moved == NULL)
+        return NULL;
+
+      moved->size = size;
+      if (moved->prev != NULL)
+        moved->prev->next = moved;
+      else
+        p->large = moved;
+      if (moved->next != NULL)
+        moved->next->prev = moved;
+
+      return moved + 1;
+    }
+
+    old_size = large->size;
+  } else {
+    old_size = class_sizes[header->size_class];
+    if (size <= old_size)
+      return ptr;
+  }
+
+  void *result = pool_malloc(p, size);
+  if (result == NULL)
+    return NULL;
+
+  memcpy(result, ptr, old_size < size ? old_size : size);
+  pool_free(p, ptr);
+
+  return result;
+}
+
+/******** mcfg_pool.h ********/
+
+mcfg_allocator *create_mcfg_pool(void) {
+  pool *p = calloc(1, sizeof(pool));
+  if (p == NULL)
+    return NULL;
+
+  p->allocator.malloc = pool_malloc;
+  p->allocator.realloc = pool_realloc;
+  p->allocator.free = pool_free;
+  p->allocator.ctx = p;
+
+  return &p->allocator;
+}
+
+void free_mcfg_pool(mcfg_allocator *allocator) {
+  pool *p = allocator->ctx;
+
+  while (p->chunks != NULL) {
+    chunk *next = p->chunks->next;
+    free(p->chunks);
+    p->chunks = next;
+  }
+
+  while (p->large != NULL) {
+    large_header *next = p->large->next;
+    free(p->large);
+    p->large = next;
+  }
+
+  free(p);
+}
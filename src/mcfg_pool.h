@@ -0,0 +1,33 @@
+/*
+ * mcfg_pool.h ; author: Marie Eckert
+ *
+ * Pool allocator for the small records and strings of mcfg files.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#ifndef MCFG_POOL_H
+#define MCFG_POOL_H
+
+#include <mcfg.h>
+
+/* Creates a pool allocator. Allocations of up to 256 bytes are carved out of
+ * 64KiB chunks and recycled through free lists per size class, which fits the
+ * mcfg_field records and the short names and values making up most of a
+ * file. Larger allocations are passed on to malloc.
+ *
+ * Notes:
+ *   - A pool is not thread-safe, use one pool per thread.
+ *   - Allocations are aligned to 8 bytes.
+ */
+mcfg_allocator *create_mcfg_pool(void);
+
+/* Releases all memory held by the pool at once, including allocations which
+ * have not been freed. No file allocated through the pool may be used
+ * afterwards.
+ */
+void free_mcfg_pool(mcfg_allocator *pool);
+
+#endif
@@ -0,0 +1,393 @@
+/*
+ * mcfg_registry.c ; author: Marie Eckert
+ *
+ * Registry of mcfg files by alias for references across files.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#include <mcfg_registry.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+/******** file private ********/
+
+/* Cross file references nested deeper than this are left unresolved, which
+ * also stops reference cycles between files.
+ */
+#define MAX_DEPTH 16
+
+typedef struct string_builder {
+  mcfg_allocator *allocator;
+  char *data;
+  size_t len;
+  size_t cap;
+} string_builder;
+
+static void append(string_builder *builder, const char *str, size_t len) {
+  if (builder->len + len + 1 > builder->cap) {
+    size_t cap = builder->cap == 0 ? 64 : builder->cap;
+    while (cap < builder->len + len + 1)
+      cap *= 2;
+
+    builder->data = mcfg_realloc(builder->allocator, builder->data, cap);
+    builder->cap = cap;
+  }
+
+  memcpy(builder->data + builder->len, str, len);
+  builder->len += len;
+  builder->data[builder->len] = 0;
+}
+
+static char *dup_string(const char *str, size_t len) {
+  char *result = mcfg_malloc(NULL, len + 1);
+  memcpy(result, str, len);
+  result[len] = 0;
+
+  return result;
+}
+
+static mcfg_registry_entry *find_entry(mcfg_registry *registry, char *alias,
+                                       int len) {
+  for (int i = 0; i < registry->entry_count; i++) {
+    mcfg_registry_entry *entry = &registry->entries[i];
+    if (strncmp(entry->alias, alias, len) == 0 && entry->alias[len] == 0)
+      return entry;
+  }
+
+  return NULL;
+}
+
+static void drop_file(mcfg_registry_entry *entry) {
+  if (entry->owned && entry->file != NULL)
+    free_mcfg_file(entry->file);
+
+  entry->file = NULL;
+  entry->owned = 0;
+  entry->result = MCFG_OK;
+}
+
+static mcfg_registry_entry *add_entry(mcfg_registry *registry, char *alias) {
+  registry->generation++;
+
+  mcfg_registry_entry *entry = find_entry(registry, alias, strlen(alias));
+  if (entry != NULL) {
+    drop_file(entry);
+    mcfg_free(NULL, entry->path);
+    entry->path = NULL;
+    return entry;
+  }
+
+  registry->entry_count++;
+  registry->entries =
+      mcfg_realloc(NULL, registry->entries,
+                   registry->entry_count * sizeof(mcfg_registry_entry));
+
+  entry = &registry->entries[registry->entry_count - 1];
+  entry->alias = dup_string(alias, strlen(alias));
+  entry->path = NULL;
+  entry->file = NULL;
+  entry->owned = 0;
+  entry->result = MCFG_OK;
+
+  return entry;
+}
+
+static mcfg_file *load_entry(mcfg_registry_entry *entry) {
+  if (entry->file != NULL || entry->path == NULL ||
+      entry->result != MCFG_OK)
+    return entry->file;
+
+  // Allocated with calloc, since free_mcfg_file frees the struct itself
+  // using free()
+  mcfg_file *file = calloc(1, sizeof(mcfg_file));
+  file->path = entry->path;
+  entry->result = parse_file(file);
+  if (entry->result != MCFG_OK) {
+    free_mcfg_file(file);
+    return NULL;
+  }
+
+  entry->file = file;
+  entry->owned = 1;
+
+  return file;
+}
+
+// FNV-1a
+static unsigned long hash_key(const char *key, int len) {
+  unsigned long hash = 14695981039346656037UL;
+  for (int i = 0; i < len; i++) {
+    hash ^= (unsigned char)key[i];
+    hash *= 1099511628211UL;
+  }
+
+  return hash;
+}
+
+static void clear_memo(mcfg_registry *registry) {
+  for (int i = 0; i < registry->memo_capacity; i++) {
+    mcfg_free(NULL, registry->memo[i].key);
+    mcfg_free(NULL, registry->memo[i].value);
+  }
+
+  mcfg_free(NULL, registry->memo);
+  registry->memo = NULL;
+  registry->memo_count = 0;
+  registry->memo_capacity = 0;
+  registry->memo_generation = registry->generation;
+}
+
+static mcfg_registry_memo *probe_memo(mcfg_registry_memo *memo, int capacity,
+                                      const char *key, int len,
+                                      unsigned long hash) {
+  int mask = capacity - 1;
+  for (int i = hash & mask;; i = (i + 1) & mask) {
+    if (memo[i].key == NULL ||
+        (memo[i].hash == hash && strncmp(memo[i].key, key, len) == 0 &&
+         memo[i].key[len] == 0))
+      return &memo[i];
+  }
+}
+
+static void grow_memo(mcfg_registry *registry) {
+  int capacity =
+      registry->memo_capacity == 0 ? 32 : registry->memo_capacity * 2;
+  mcfg_registry_memo *memo =
+      mcfg_malloc(NULL, capacity * sizeof(mcfg_registry_memo));
+  memset(memo, 0, capacity * sizeof(mcfg_registry_memo));
+
+  for (int i = 0; i < registry->memo_capacity; i++) {
+    mcfg_registry_memo *old = &registry->memo[i];
+    if (old->key != NULL)
+      *probe_memo(memo, capacity, old->key, strlen(old->key), old->hash) =
+          *old;
+  }
+
+  mcfg_free(NULL, registry->memo);
+  registry->memo = memo;
+  registry->memo_capacity = capacity;
+}
+
+static char *resolve_cross(mcfg_registry *registry, mcfg_allocator *allocator,
+                           char *in, int leave_lists, int depth);
+
+/* Resolves a single cross file reference, the key is the reference without
+ * $() followed by the leave_lists flag. Returns NULL if it can not be resolved.
+ * The elements of a list are resolved without formatting nested lists, list
+ * is set if the referenced field is a list so that the caller can format it
+ * in place.
+ */
+static char *resolve_reference(mcfg_registry *registry, char *key, int len,
+                               int alias_len, int leave_lists, int depth,
+                               int *list) {
+  unsigned long hash = hash_key(key, len);
+  if (registry->memo_capacity > 0) {
+    mcfg_registry_memo *memo =
+        probe_memo(registry->memo, registry->memo_capacity, key, len, hash);
+    if (memo->key != NULL) {
+      *list = memo->list;
+      return memo->value;
+    }
+  }
+
+  mcfg_registry_entry *entry = find_entry(registry, key, alias_len);
+  mcfg_file *file = entry == NULL ? NULL : load_entry(entry);
+  if (file == NULL)
+    return NULL;
+
+  // The path without the flag, and the context being the path up to and
+  // including the last slash
+  char *path = dup_string(key + alias_len + 1, len - alias_len - 2);
+  mcfg_field *field = find_field(file, path);
+  if (field == NULL || field->value == NULL) {
+    mcfg_free(NULL, path);
+    return NULL;
+  }
+
+  char *slash = strrchr(path, '/');
+  slash[1] = 0;
+
+  *list = field->type == FT_LIST;
+  if (*list)
+    leave_lists = 1;
+
+  char *resolved = resolve_fields(*file, field->value, path, leave_lists);
+  char *value = resolve_cross(registry, NULL, resolved, leave_lists, depth + 1);
+  mcfg_free(file->allocator, resolved);
+  mcfg_free(NULL, path);
+
+  // Resolving may have parsed further files, but the mapping itself and so
+  // the generation stays the same.
+  if (registry->memo_count * 2 >= registry->memo_capacity)
+    grow_memo(registry);
+
+  // A reference cycle has already memoized the innermost resolution
+  mcfg_registry_memo *memo =
+      probe_memo(registry->memo, registry->memo_capacity, key, len, hash);
+  if (memo->key != NULL) {
+    mcfg_free(NULL, value);
+    *list = memo->list;
+    return memo->value;
+  }
+
+  memo->key = dup_string(key, len);
+  memo->hash = hash;
+  memo->value = value;
+  memo->list = *list;
+  registry->memo_count++;
+
+  return value;
+}
+
+/* Replaces all cross file references within in, the result is allocated
+ * through the given allocator.
+ */
+static char *resolve_cross(mcfg_registry *registry, mcfg_allocator *allocator,
+                           char *in, int leave_lists, int depth) {
+  string_builder builder = {allocator, NULL, 0, 0};
+  char *key = NULL;
+  size_t key_cap = 0;
+
+  char *copied = in;
+  char *start;
+  while ((start = strstr(copied, "$(")) != NULL) {
+    char *end = strchr(start + 2, ')');
+    if (end == NULL)
+      break;
+
+    // An alias is followed by a colon before the first slash
+    char *name = start + 2;
+    int alias_len = strcspn(name, ":/)");
+    char *value = NULL;
+    char *formatted = NULL;
+    int list = 0;
+
+    if (name[alias_len] == ':' && alias_len > 0 && depth < MAX_DEPTH) {
+      int len = end - name;
+      if (key_cap < len + 2) {
+        key_cap = len + 2;
+        key = mcfg_realloc(NULL, key, key_cap);
+      }
+
+      memcpy(key, name, len);
+      key[len] = leave_lists == 1 ? '1' : '0';
+      value = resolve_reference(registry, key, len + 1, alias_len, leave_lists,
+                                depth, &list);
+    }
+
+    // The list is formatted from its resolved elements, the text around the
+    // reference is taken from in just like resolve_fields does
+    if (value != NULL && list && leave_lists != 1) {
+      mcfg_file empty = {0};
+      mcfg_field field = {.type = FT_LIST, .value = value};
+      formatted =
+          format_list_field(empty, field, "", in, start - in, end - start);
+      value = formatted;
+    }
+
+    append(&builder, copied, start - copied);
+    if (value != NULL)
+      append(&builder, value, strlen(value));
+    else
+      append(&builder, start, end + 1 - start);
+    copied = end + 1;
+
+    if (formatted != NULL && strcmp(formatted, "") != 0)
+      mcfg_free(NULL, formatted);
+  }
+
+  append(&builder, copied, strlen(copied));
+  mcfg_free(NULL, key);
+
+  return builder.data;
+}
+
+/******** mcfg_registry.h ********/
+
+void init_mcfg_registry(mcfg_registry *registry) {
+  memset(registry, 0, sizeof(mcfg_registry));
+}
+
+void free_mcfg_registry(mcfg_registry *registry) {
+  clear_memo(registry);
+
+  for (int i = 0; i < registry->entry_count; i++) {
+    drop_file(&registry->entries[i]);
+    mcfg_free(NULL, registry->entries[i].alias);
+    mcfg_free(NULL, registry->entries[i].path);
+  }
+
+  mcfg_free(NULL, registry->entries);
+  init_mcfg_registry(registry);
+}
+
+int add_mcfg_registry_path(mcfg_registry *registry, char *alias, char *path) {
+  if (alias == NULL || path == NULL || strpbrk(alias, ":/)") != NULL)
+    return MCFG_ERR_UNKNOWN;
+
+  mcfg_registry_entry *entry = add_entry(registry, alias);
+  entry->path = dup_string(path, strlen(path));
+
+  return MCFG_OK;
+}
+
+int add_mcfg_registry_file(mcfg_registry *registry, char *alias,
+                           mcfg_file *file) {
+  if (alias == NULL || file == NULL || strpbrk(alias, ":/)") != NULL)
+    return MCFG_ERR_UNKNOWN;
+
+  mcfg_registry_entry *entry = add_entry(registry, alias);
+  entry->file = file;
+
+  return MCFG_OK;
+}
+
+int reload_mcfg_registry_path(mcfg_registry *registry, char *alias) {
+  mcfg_registry_entry *entry = find_entry(registry, alias, strlen(alias));
+  if (entry == NULL || entry->path == NULL)
+    return MCFG_ERR_UNKNOWN;
+
+  drop_file(entry);
+  registry->generation++;
+
+  return MCFG_OK;
+}
+
+mcfg_file *get_mcfg_registry_file(mcfg_registry *registry, char *alias,
+                                  int *result) {
+  mcfg_registry_entry *entry = find_entry(registry, alias, strlen(alias));
+  if (entry == NULL) {
+    if (result != NULL)
+      *result = MCFG_ERR_UNKNOWN;
+    return NULL;
+  }
+
+  mcfg_file *file = load_entry(entry);
+  if (result != NULL)
+    *result = entry->result;
+
+  return file;
+}
+
+char *resolve_registry_fields(mcfg_registry *registry, mcfg_file *file,
+                              char *in, char *context, int leave_lists) {
+  if (registry->memo_generation != registry->generation)
+    clear_memo(registry);
+
+  if (file == NULL)
+    return resolve_cross(registry, NULL, in, leave_lists, 0);
+
+  char *resolved = resolve_fields(*file, in, context, leave_lists);
+  if (strstr(resolved, "$(") == NULL)
+    return resolved;
+
+  char *out =
+      resolve_cross(registry, file->allocator, resolved, leave_lists, 0);
+  mcfg_free(file->allocator, resolved);
+
+  return out;
+}
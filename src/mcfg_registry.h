@@ -0,0 +1,108 @@
+/*
+ * mcfg_registry.h ; author: Marie Eckert
+ *
+ * Registry of mcfg files by alias for references across files.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#ifndef MCFG_REGISTRY_H
+#define MCFG_REGISTRY_H
+
+#include <mcfg.h>
+
+typedef struct mcfg_registry_entry {
+  char *alias;
+  char *path;
+  mcfg_file *file;
+  int owned;
+  int result;
+} mcfg_registry_entry;
+
+typedef struct mcfg_registry_memo {
+  char *key;
+  unsigned long hash;
+  char *value;
+  int list;
+} mcfg_registry_memo;
+
+/* Maps aliases to mcfg files.
+ *
+ * Files registered by path are parsed on first use and kept until the
+ * registry is freed. generation is increased whenever the mapping changes,
+ * resolved cross file references are memoized per generation.
+ *
+ * A registry is not thread-safe.
+ */
+typedef struct mcfg_registry {
+  int entry_count;
+  mcfg_registry_entry *entries;
+  unsigned long generation;
+
+  unsigned long memo_generation;
+  int memo_count;
+  int memo_capacity;
+  mcfg_registry_memo *memo;
+} mcfg_registry;
+
+/* Initialises an empty registry. */
+void init_mcfg_registry(mcfg_registry *registry);
+
+/* Frees the registry and all files it has parsed, files registered through
+ * add_mcfg_registry_file are left untouched.
+ */
+void free_mcfg_registry(mcfg_registry *registry);
+
+/* Registers the file under the given path as alias, the file is parsed on
+ * first use. An already registered alias is replaced.
+ */
+int add_mcfg_registry_path(mcfg_registry *registry, char *alias, char *path);
+
+/* Registers an already parsed file as alias, the file is borrowed and has to
+ * outlive the registry. An already registered alias is replaced.
+ */
+int add_mcfg_registry_file(mcfg_registry *registry, char *alias,
+                           mcfg_file *file);
+
+/* Drops the parsed file of the alias so it is parsed again on its next use,
+ * e.g. after the file changed on disk.
+ */
+int reload_mcfg_registry_path(mcfg_registry *registry, char *alias);
+
+/* Returns the file registered as alias, parsing it if necessary. Returns NULL
+ * if the alias is unknown or parsing failed, in which case the result of
+ * parsing is stored in result if it is not NULL.
+ */
+mcfg_file *get_mcfg_registry_file(mcfg_registry *registry, char *alias,
+                                  int *result);
+
+/* Like resolve_fields, but additionally resolves references of the form
+ * "$(alias:sector/section/field)" against the files of the registry.
+ *
+ * Parameters:
+ *   registry   : The registry to resolve cross file references with
+ *   file       : The file for plain references, may be NULL
+ *   in         : The input string to be resolved
+ *   context    : The context for local references within file
+ *   leave_lists: See resolve_fields
+ *
+ * Returns:
+ *   A dynamically allocated string, which has to be freed using
+ *   mcfg_free(file->allocator, result) or mcfg_free(NULL, result) if file is
+ *   NULL.
+ *
+ * Notes:
+ *   - Plain references are resolved first, so fields of file may contain
+ *     cross file references as well.
+ *   - The value of a referenced field is resolved within its own file, with
+ *     its section as the context.
+ *   - Referenced list fields are formatted like resolve_fields formats local
+ *     lists, unless leave_lists is 1.
+ *   - References to unknown aliases or fields are left as they are.
+ */
+char *resolve_registry_fields(mcfg_registry *registry, mcfg_file *file,
+                              char *in, char *context, int leave_lists);
+
+#endif
@@ -0,0 +1,315 @@
+/*
+ * mcfg_render.c ; author: Marie Eckert
+ *
+ * Line by line rendering of lines sections with field references.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#include <mcfg_render.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/******** file private ********/
+
+#define CHUNK_SIZE (16 * 1024)
+#define CONFIG_PREFIX ".config/"
+
+/* A reference resolved once and reused for every further occurrence. value is
+ * NULL if the reference can not be resolved. For lists which are to be
+ * formatted, value holds the resolved elements separated by colons.
+ */
+typedef struct compiled_ref {
+  char *key;
+  int key_len;
+  unsigned long hash;
+  int is_list;
+  char *value;
+} compiled_ref;
+
+typedef struct renderer {
+  mcfg_file *file;
+  mcfg_allocator *allocator;
+  char *context;
+  int leave_lists;
+  mcfg_sink sink;
+  int result;
+
+  int ref_count;
+  int ref_capacity;
+  compiled_ref *refs;
+
+  size_t len;
+  char buffer[CHUNK_SIZE];
+} renderer;
+
+static int stdio_write(void *user, const char *data, size_t len) {
+  if (fwrite(data, 1, len, user) != len)
+    return MCFG_ERR_MASK_ERRNO | errno;
+
+  return MCFG_OK;
+}
+
+static int fd_write(void *user, const char *data, size_t len) {
+  int fd = (intptr_t)user;
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written < 0 && errno == EINTR)
+      continue;
+
+    if (written < 0)
+      return MCFG_ERR_MASK_ERRNO | errno;
+
+    data += written;
+    len -= written;
+  }
+
+  return MCFG_OK;
+}
+
+static void flush(renderer *r) {
+  if (r->result == MCFG_OK && r->len > 0)
+    r->result = r->sink.write(r->sink.user, r->buffer, r->len);
+
+  r->len = 0;
+}
+
+static void emit(renderer *r, const char *data, size_t len) {
+  if (r->result != MCFG_OK)
+    return;
+
+  if (r->len + len > CHUNK_SIZE)
+    flush(r);
+
+  if (len >= CHUNK_SIZE) {
+    if (r->result == MCFG_OK)
+      r->result = r->sink.write(r->sink.user, data, len);
+    return;
+  }
+
+  memcpy(r->buffer + r->len, data, len);
+  r->len += len;
+}
+
+// FNV-1a
+static unsigned long hash_key(const char *key, int len) {
+  unsigned long hash = 14695981039346656037UL;
+  for (int i = 0; i < len; i++) {
+    hash ^= (unsigned char)key[i];
+    hash *= 1099511628211UL;
+  }
+
+  return hash;
+}
+
+static compiled_ref *probe(compiled_ref *refs, int capacity, const char *key,
+                           int len, unsigned long hash) {
+  int mask = capacity - 1;
+  for (int i = hash & mask;; i = (i + 1) & mask) {
+    if (refs[i].key == NULL ||
+        (refs[i].hash == hash && refs[i].key_len == len &&
+         memcmp(refs[i].key, key, len) == 0))
+      return &refs[i];
+  }
+}
+
+static void grow_refs(renderer *r) {
+  int capacity = r->ref_capacity == 0 ? 16 : r->ref_capacity * 2;
+  compiled_ref *refs = mcfg_malloc(r->allocator, capacity * sizeof(*refs));
+  memset(refs, 0, capacity * sizeof(*refs));
+
+  for (int i = 0; i < r->ref_capacity; i++)
+    if (r->refs[i].key != NULL)
+      *probe(refs, capacity, r->refs[i].key, r->refs[i].key_len,
+             r->refs[i].hash) = r->refs[i];
+
+  mcfg_free(r->allocator, r->refs);
+  r->refs = refs;
+  r->ref_capacity = capacity;
+}
+
+/* Builds the path of a reference the same way resolve_fields does */
+static char *reference_path(renderer *r, const char *name, int len) {
+  const char *prefix = "";
+  if (memchr(name, '/', len) == NULL)
+    prefix = r->context;
+  else if (len < strlen(CONFIG_PREFIX) ||
+           memcmp(name, CONFIG_PREFIX, strlen(CONFIG_PREFIX)) != 0)
+    prefix = CONFIG_PREFIX;
+
+  size_t prefix_len = strlen(prefix);
+  char *path = mcfg_malloc(r->allocator, prefix_len + len + 1);
+  memcpy(path, prefix, prefix_len);
+  memcpy(path + prefix_len, name, len);
+  path[prefix_len + len] = 0;
+
+  return path;
+}
+
+static compiled_ref *compile(renderer *r, const char *name, int len) {
+  unsigned long hash = hash_key(name, len);
+  if (r->ref_capacity > 0) {
+    compiled_ref *ref = probe(r->refs, r->ref_capacity, name, len, hash);
+    if (ref->key != NULL)
+      return ref;
+  }
+
+  if (r->ref_count * 2 >= r->ref_capacity)
+    grow_refs(r);
+
+  compiled_ref *ref = probe(r->refs, r->ref_capacity, name, len, hash);
+  ref->key = mcfg_malloc(r->allocator, len);
+  memcpy(ref->key, name, len);
+  ref->key_len = len;
+  ref->hash = hash;
+  r->ref_count++;
+
+  char *path = reference_path(r, name, len);
+  mcfg_field *field = find_field(r->file, path);
+  mcfg_free(r->allocator, path);
+
+  if (field == NULL || field->value == NULL)
+    return ref;
+
+  ref->is_list = field->type == FT_LIST && r->leave_lists != 1;
+  ref->value = resolve_fields(*r->file, field->value, r->context,
+                              ref->is_list ? 1 : r->leave_lists);
+
+  return ref;
+}
+
+/* Emits the elements of a list, the text around the reference is emitted by
+ * the caller, so only the repetitions of prefix and postfix are added here.
+ */
+static void emit_list(renderer *r, char *value, const char *prefix,
+                      int prefix_len, const char *postfix, int postfix_len) {
+  if (prefix_len > 0 && prefix[prefix_len - 1] == ':')
+    prefix_len = 0;
+
+  if (postfix_len > 0 && postfix[0] == ':')
+    postfix_len = 0;
+
+  int first = 1;
+  char *elem = value;
+  while (*elem != 0) {
+    char *end = strchr(elem, ':');
+    int len = end == NULL ? strlen(elem) : end - elem;
+
+    // Empty elements are skipped like strtok does
+    if (len > 0) {
+      if (!first) {
+        emit(r, postfix, postfix_len);
+        emit(r, " ", 1);
+        emit(r, prefix, prefix_len);
+      }
+
+      emit(r, elem, len);
+      first = 0;
+    }
+
+    if (end == NULL)
+      break;
+    elem = end + 1;
+  }
+}
+
+static void render_line(renderer *r, char *line, int len) {
+  int copied = 0;
+
+  for (int i = 0; i + 1 < len; i++) {
+    if (line[i] != '$' || line[i + 1] != '(')
+      continue;
+
+    char *close = memchr(line + i + 2, ')', len - i - 2);
+    if (close == NULL)
+      break;
+
+    int name_len = close - (line + i + 2);
+    compiled_ref *ref = compile(r, line + i + 2, name_len);
+    int end = close - line + 1;
+    if (ref->value == NULL) {
+      i = end - 1;
+      continue;
+    }
+
+    emit(r, line + copied, i - copied);
+    if (ref->is_list) {
+      int prefix_start = i;
+      while (prefix_start > 0 && line[prefix_start - 1] != ' ')
+        prefix_start--;
+
+      int postfix_end = end;
+      while (postfix_end < len && line[postfix_end] != ' ')
+        postfix_end++;
+
+      emit_list(r, ref->value, line + prefix_start, i - prefix_start,
+                line + end, postfix_end - end);
+    } else {
+      emit(r, ref->value, strlen(ref->value));
+    }
+
+    copied = end;
+    i = end - 1;
+  }
+
+  emit(r, line + copied, len - copied);
+}
+
+/******** mcfg_render.h ********/
+
+mcfg_sink mcfg_stdio_sink(FILE *out) {
+  return (mcfg_sink){stdio_write, out};
+}
+
+mcfg_sink mcfg_fd_sink(int fd) {
+  return (mcfg_sink){fd_write, (void *)(intptr_t)fd};
+}
+
+int render_mcfg_lines(mcfg_file *file, mcfg_section *section, char *context,
+                      mcfg_sink sink, int leave_lists) {
+  if (section->lines == NULL)
+    return MCFG_OK;
+
+  mcfg_allocator *allocator =
+      file->allocator != NULL ? file->allocator : get_mcfg_allocator();
+  renderer *r = mcfg_malloc(allocator, sizeof(renderer));
+  *r = (renderer){.file = file,
+                  .allocator = allocator,
+                  .context = context,
+                  .leave_lists = leave_lists,
+                  .sink = sink,
+                  .result = MCFG_OK};
+
+  char *line = section->lines;
+  char *end = section->lines + section->lines_len;
+  while (line < end && r->result == MCFG_OK) {
+    char *newline = memchr(line, '\n', end - line);
+    int len = (newline == NULL ? end : newline) - line;
+
+    render_line(r, line, len);
+    if (newline != NULL)
+      emit(r, "\n", 1);
+
+    line += len + 1;
+  }
+
+  flush(r);
+  int result = r->result;
+
+  for (int i = 0; i < r->ref_capacity; i++) {
+    if (r->refs[i].key == NULL)
+      continue;
+
+    mcfg_free(allocator, r->refs[i].key);
+    mcfg_free(allocator, r->refs[i].value);
+  }
+  mcfg_free(allocator, r->refs);
+  mcfg_free(allocator, r);
+
+  return result;
+}
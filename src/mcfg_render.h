@@ -0,0 +1,53 @@
+/*
+ * mcfg_render.h ; author: Marie Eckert
+ *
+ * Line by line rendering of lines sections with field references.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#ifndef MCFG_RENDER_H
+#define MCFG_RENDER_H
+
+#include <stdio.h>
+
+#include <mcfg.h>
+
+/* Receives the rendered output in chunks. Returning anything but MCFG_OK
+ * aborts rendering with that code.
+ */
+typedef struct mcfg_sink {
+  int (*write)(void *user, const char *data, size_t len);
+  void *user;
+} mcfg_sink;
+
+/* Sinks writing to a stdio stream or a file descriptor */
+mcfg_sink mcfg_stdio_sink(FILE *out);
+mcfg_sink mcfg_fd_sink(int fd);
+
+/* Renders the lines of a lines section into the sink, replacing field
+ * references like resolve_fields does.
+ *
+ * Parameters:
+ *   file       : The file to resolve references against
+ *   section    : The lines section to render
+ *   context    : Path of the section used for local references
+ *   sink       : The sink receiving the output
+ *   leave_lists: See resolve_fields
+ *
+ * Returns:
+ *   MCFG_OK or the first error returned by the sink.
+ *
+ * Notes:
+ *   - Every distinct reference is resolved only once per call, the output is
+ *     passed to the sink in chunks of a fixed size. Memory use therefore only
+ *     depends on the referenced values, not on the size of the section.
+ *   - The prefix and postfix repeated for every element of a list field end
+ *     at whitespace or the end of the line.
+ */
+int render_mcfg_lines(mcfg_file *file, mcfg_section *section, char *context,
+                      mcfg_sink sink, int leave_lists);
+
+#endif
@@ -0,0 +1,417 @@
+/*
+ * mcfg_shm.c ; author: Marie Eckert
+ *
+ * Distribution of parsed mcfg files to other processes through POSIX shared
+ * memory.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#include <mcfg_shm.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <mcfg_overlay.h>
+
+/******** file private ********/
+
+#define IMAGE_MAGIC 0x4d434647 // "MCFG"
+#define IMAGE_VERSION 2
+#define IMAGE_ALIGN 16
+
+/* The control object under the plain name only holds the number of the
+ * current generation, the images are published as <name>.<generation>.
+ */
+typedef struct shm_control {
+  atomic_ulong generation;
+} shm_control;
+
+typedef struct image_header {
+  unsigned int magic;
+  unsigned int version;
+  unsigned long generation;
+  size_t size;
+  uintptr_t base;
+} image_header;
+
+typedef struct image_writer {
+  char *base;
+  size_t offs;
+} image_writer;
+
+static size_t align_size(size_t size) {
+  return (size + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+}
+
+static size_t string_size(char *str) {
+  return str == NULL ? 0 : strlen(str) + 1;
+}
+
+static size_t image_size(mcfg_file *file) {
+  size_t size =
+      align_size(sizeof(image_header)) + align_size(sizeof(mcfg_file));
+  size_t strings = string_size(file->path);
+
+  size += align_size(file->sector_count * sizeof(mcfg_sector));
+  for (int i = 0; i < file->sector_count; i++) {
+    mcfg_sector *sector = &file->sectors[i];
+    strings += string_size(sector->name);
+    size += align_size(sector->section_count * sizeof(mcfg_section));
+
+    for (int j = 0; j < sector->section_count; j++) {
+      mcfg_section *section = &sector->sections[j];
+      strings += string_size(section->name);
+      strings += section->lines == NULL ? 0 : section->lines_len + 1;
+      size += align_size(section->field_count * sizeof(mcfg_field));
+
+      for (int k = 0; k < section->field_count; k++)
+        strings += string_size(section->fields[k].name) +
+                   string_size(section->fields[k].value);
+    }
+  }
+
+  return size + strings;
+}
+
+static void *image_alloc(image_writer *writer, size_t size) {
+  void *result = writer->base + writer->offs;
+  writer->offs += align_size(size);
+
+  return result;
+}
+
+static char *image_strdup(image_writer *writer, char *str, size_t len) {
+  if (str == NULL)
+    return NULL;
+
+  char *result = writer->base + writer->offs;
+  memcpy(result, str, len);
+  result[len] = 0;
+  writer->offs += len + 1;
+
+  return result;
+}
+
+/* Writes the image, the strings are placed behind all of the arrays so that
+ * the structure of the tree is kept in as few pages as possible.
+ */
+static void write_image(image_writer *writer, mcfg_file *src) {
+  mcfg_file *file = image_alloc(writer, sizeof(mcfg_file));
+  *file = (mcfg_file){0};
+  file->hash = src->hash;
+  file->generation = src->generation;
+  file->revision = src->revision;
+  file->sector_count = src->sector_count;
+  file->sectors = image_alloc(writer, src->sector_count * sizeof(mcfg_sector));
+
+  for (int i = 0; i < src->sector_count; i++) {
+    mcfg_sector *sector = &file->sectors[i];
+    *sector = src->sectors[i];
+    sector->allocator = NULL;
+    sector->sections =
+        image_alloc(writer, sector->section_count * sizeof(mcfg_section));
+
+    for (int j = 0; j < sector->section_count; j++) {
+      mcfg_section *section = &sector->sections[j];
+      *section = src->sectors[i].sections[j];
+      section->allocator = NULL;
+      section->fields =
+          image_alloc(writer, section->field_count * sizeof(mcfg_field));
+      memcpy(section->fields, src->sectors[i].sections[j].fields,
+             section->field_count * sizeof(mcfg_field));
+    }
+  }
+
+  file->path = image_strdup(writer, src->path, string_size(src->path) - 1);
+  for (int i = 0; i < file->sector_count; i++) {
+    mcfg_sector *sector = &file->sectors[i];
+    sector->name = image_strdup(writer, sector->name, strlen(sector->name));
+
+    for (int j = 0; j < sector->section_count; j++) {
+      mcfg_section *section = &sector->sections[j];
+      section->name =
+          image_strdup(writer, section->name, strlen(section->name));
+      section->lines = image_strdup(writer, section->lines, section->lines_len);
+
+      for (int k = 0; k < section->field_count; k++) {
+        mcfg_field *field = &section->fields[k];
+        field->name = image_strdup(writer, field->name, strlen(field->name));
+        field->value =
+            image_strdup(writer, field->value, strlen(field->value));
+      }
+    }
+  }
+}
+
+#define RELOCATE(ptr, delta)                                                   \
+  if ((ptr) != NULL)                                                           \
+  (ptr) = (void *)((char *)(ptr) + (delta))
+
+static void relocate_image(mcfg_file *file, ptrdiff_t delta) {
+  RELOCATE(file->path, delta);
+  RELOCATE(file->sectors, delta);
+
+  for (int i = 0; i < file->sector_count; i++) {
+    mcfg_sector *sector = &file->sectors[i];
+    RELOCATE(sector->name, delta);
+    RELOCATE(sector->sections, delta);
+
+    for (int j = 0; j < sector->section_count; j++) {
+      mcfg_section *section = &sector->sections[j];
+      RELOCATE(section->name, delta);
+      RELOCATE(section->lines, delta);
+      RELOCATE(section->fields, delta);
+
+      for (int k = 0; k < section->field_count; k++) {
+        RELOCATE(section->fields[k].name, delta);
+        RELOCATE(section->fields[k].value, delta);
+      }
+    }
+  }
+}
+
+/* NOTE: The returned string of this function has to be freed after usage!!!
+ */
+static char *image_name(char *name, unsigned long generation) {
+  int len = snprintf(NULL, 0, "%s.%lu", name, generation);
+  char *result = mcfg_malloc(NULL, len + 1);
+  snprintf(result, len + 1, "%s.%lu", name, generation);
+
+  return result;
+}
+
+static shm_control *map_control(char *name, int writable) {
+  int fd = shm_open(name, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  if (fd == -1)
+    return NULL;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (st.st_size < sizeof(shm_control) &&
+       (!writable || ftruncate(fd, sizeof(shm_control)) != 0))) {
+    int err = errno == 0 ? EINVAL : errno;
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+
+  void *control = mmap(NULL, sizeof(shm_control),
+                       writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                       MAP_SHARED, fd, 0);
+  close(fd);
+
+  return control == MAP_FAILED ? NULL : control;
+}
+
+static int map_image(mcfg_shm *shm, unsigned long generation) {
+  char *path = image_name(shm->name, generation);
+  int fd = shm_open(path, O_RDONLY, 0);
+  mcfg_free(NULL, path);
+  if (fd == -1)
+    return MCFG_ERR_MASK_ERRNO | errno;
+
+  image_header header;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != IMAGE_MAGIC || header.version != IMAGE_VERSION) {
+    close(fd);
+    return MCFG_ERR_INVALID_IMAGE;
+  }
+
+  int flags = MAP_SHARED;
+#ifdef MAP_FIXED_NOREPLACE
+  flags |= MAP_FIXED_NOREPLACE;
+#endif
+
+  // Try to map the image at the address its pointers were written for
+  void *base = mmap((void *)header.base, header.size, PROT_READ, flags, fd, 0);
+  int relocated = 0;
+
+  if (base != (void *)header.base) {
+    if (base != MAP_FAILED)
+      munmap(base, header.size);
+
+    base = mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+      close(fd);
+      return MCFG_ERR_MASK_ERRNO | errno;
+    }
+
+    relocated = 1;
+  }
+
+  close(fd);
+
+  mcfg_file *file = (mcfg_file *)((char *)base + align_size(sizeof(header)));
+  if (relocated) {
+    relocate_image(file, (char *)base - (char *)header.base);
+    mprotect(base, header.size, PROT_READ);
+  }
+
+  if (shm->base != NULL)
+    munmap(shm->base, shm->size);
+
+  shm->generation = generation;
+  shm->file = file;
+  shm->base = base;
+  shm->size = header.size;
+  shm->relocated = relocated;
+
+  return MCFG_OK;
+}
+
+/******** mcfg_shm.h ********/
+
+int publish_mcfg_shm(char *name, mcfg_file *file, unsigned long *generation) {
+  mcfg_overlay flattened;
+  int ret = build_mcfg_overlay(&flattened, &file, 1);
+  if (ret != MCFG_OK)
+    return ret;
+
+  flattened.merged.path = file->path;
+
+  errno = 0;
+  shm_control *control = map_control(name, 1);
+  if (control == NULL) {
+    free_mcfg_overlay(&flattened);
+    return MCFG_ERR_MASK_ERRNO | errno;
+  }
+
+  unsigned long gen = atomic_load(&control->generation) + 1;
+  char *path = image_name(name, gen);
+  size_t size = image_size(&flattened.merged);
+
+  int fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+  void *base = MAP_FAILED;
+  if (fd != -1 && ftruncate(fd, size) == 0)
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (base == MAP_FAILED) {
+    ret = MCFG_ERR_MASK_ERRNO | errno;
+    if (fd != -1) {
+      close(fd);
+      shm_unlink(path);
+    }
+
+    goto publish_mcfg_shm_done;
+  }
+
+  close(fd);
+
+  image_header *header = base;
+  header->magic = IMAGE_MAGIC;
+  header->version = IMAGE_VERSION;
+  header->generation = gen;
+  header->size = size;
+  header->base = (uintptr_t)base;
+
+  image_writer writer = {base, align_size(sizeof(image_header))};
+  write_image(&writer, &flattened.merged);
+  munmap(base, size);
+
+  atomic_store(&control->generation, gen);
+
+  // Processes which still map the old generation keep it until they refresh
+  if (gen > 1) {
+    char *old_path = image_name(name, gen - 1);
+    shm_unlink(old_path);
+    mcfg_free(NULL, old_path);
+  }
+
+  if (generation != NULL)
+    *generation = gen;
+
+publish_mcfg_shm_done:
+  mcfg_free(NULL, path);
+  munmap(control, sizeof(shm_control));
+  free_mcfg_overlay(&flattened);
+
+  return ret;
+}
+
+int unlink_mcfg_shm(char *name) {
+  errno = 0;
+  shm_control *control = map_control(name, 0);
+  if (control == NULL)
+    return MCFG_ERR_MASK_ERRNO | errno;
+
+  char *path = image_name(name, atomic_load(&control->generation));
+  shm_unlink(path);
+  mcfg_free(NULL, path);
+  munmap(control, sizeof(shm_control));
+
+  if (shm_unlink(name) != 0)
+    return MCFG_ERR_MASK_ERRNO | errno;
+
+  return MCFG_OK;
+}
+
+int attach_mcfg_shm(mcfg_shm *shm, char *name) {
+  shm->name = mcfg_malloc(NULL, strlen(name) + 1);
+  strcpy(shm->name, name);
+  shm->generation = 0;
+  shm->file = NULL;
+  shm->base = NULL;
+  shm->size = 0;
+  shm->relocated = 0;
+
+  errno = 0;
+  shm->control = map_control(name, 0);
+  if (shm->control == NULL) {
+    int ret = MCFG_ERR_MASK_ERRNO | errno;
+    mcfg_free(NULL, shm->name);
+    return ret;
+  }
+
+  int ret = refresh_mcfg_shm(shm);
+  if (ret != MCFG_OK || shm->file == NULL) {
+    detach_mcfg_shm(shm);
+    return ret != MCFG_OK ? ret : MCFG_ERR_MASK_ERRNO | ENOENT;
+  }
+
+  return MCFG_OK;
+}
+
+int refresh_mcfg_shm(mcfg_shm *shm) {
+  shm_control *control = shm->control;
+  unsigned long generation = atomic_load(&control->generation);
+
+  while (generation != 0 && generation != shm->generation) {
+    int ret = map_image(shm, generation);
+    if (ret == MCFG_OK)
+      return MCFG_OK;
+
+    // The generation might have been replaced while it was being mapped
+    unsigned long latest = atomic_load(&control->generation);
+    if (latest == generation)
+      return ret;
+
+    generation = latest;
+  }
+
+  return MCFG_OK;
+}
+
+void detach_mcfg_shm(mcfg_shm *shm) {
+  if (shm->base != NULL)
+    munmap(shm->base, shm->size);
+
+  if (shm->control != NULL)
+    munmap(shm->control, sizeof(shm_control));
+
+  mcfg_free(NULL, shm->name);
+  shm->name = NULL;
+  shm->file = NULL;
+  shm->base = NULL;
+  shm->control = NULL;
+}
@@ -0,0 +1,86 @@
+/*
+ * mcfg_shm.h ; author: Marie Eckert
+ *
+ * Distribution of parsed mcfg files to other processes through POSIX shared
+ * memory.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#ifndef MCFG_SHM_H
+#define MCFG_SHM_H
+
+#include <mcfg.h>
+
+/* A read-only mapping of a published mcfg file.
+ *
+ * file can be used with all navigation functions and resolve_fields, it must
+ * neither be modified nor freed. It stays valid until the mapping is
+ * detached or replaced by refresh_mcfg_shm.
+ */
+typedef struct mcfg_shm {
+  char *name;
+  unsigned long generation;
+  mcfg_file *file;
+
+  void *control;
+  void *base;
+  size_t size;
+  int relocated;
+} mcfg_shm;
+
+/* Publishes the given file as a new generation under the given name.
+ *
+ * Parameters:
+ *   name      : The name of the shared memory object, has to start with "/"
+ *   file      : The file to be published; Its imports are merged into the
+ *             | published image
+ *   generation: If not NULL, the number of the new generation is written to it
+ *
+ * Returns:
+ *  One of the declared MCFG return codes; MCFG_OK if everything was successful
+ *
+ * Notes:
+ *   - The file is copied into a single relocatable image which is mapped by
+ *     all attached processes, so it is held in memory only once.
+ *   - Only one process may publish under a name at a time. The previous
+ *     generation is unlinked after the new one has been published, processes
+ *     still mapping it keep it until they refresh.
+ */
+int publish_mcfg_shm(char *name, mcfg_file *file, unsigned long *generation);
+
+/* Removes all shared memory objects published under the given name.
+ */
+int unlink_mcfg_shm(char *name);
+
+/* Maps the current generation published under the given name read-only.
+ *
+ * Returns:
+ *  One of the declared MCFG return codes; MCFG_OK if everything was successful
+ *
+ * Notes:
+ *   - The image is mapped at the address it was published for whenever that
+ *     address is free. Otherwise a private copy is mapped and its pointers
+ *     are relocated, which duplicates the pages holding the tree structure.
+ */
+int attach_mcfg_shm(mcfg_shm *shm, char *name);
+
+/* Maps the latest generation if a newer one has been published. Checking for
+ * a new generation is a single atomic load.
+ *
+ * Returns:
+ *  One of the declared MCFG return codes; MCFG_OK if everything was successful
+ *
+ * Notes:
+ *   - If a new generation was mapped, all pointers into shm->file become
+ *     invalid.
+ */
+int refresh_mcfg_shm(mcfg_shm *shm);
+
+/* Unmaps the published file and frees all resources held by shm.
+ */
+void detach_mcfg_shm(mcfg_shm *shm);
+
+#endif
@@ -0,0 +1,404 @@
+/*
+ * mcfg_trace.c ; author: Marie Eckert
+ *
+ * Collection of lookup statistics through the mcfg trace hooks.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#include <mcfg_trace.h>
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/******** file private ********/
+
+/* Bucket i of the latency histogram holds lookups which took less than
+ * 2^(i + HISTOGRAM_SHIFT + 1) nanoseconds, the last bucket everything above.
+ */
+#define HISTOGRAM_BUCKETS 20
+#define HISTOGRAM_SHIFT 6
+
+/* Number of samples a thread records before merging its table into the
+ * shared one.
+ */
+#define FLUSH_INTERVAL 1024
+
+/* Tables track at most MAX_ENTRIES distinct keys, further keys are counted
+ * by an OTHER_KEY entry of their kind. Inputs of resolve_fields are cut off
+ * after RESOLVE_KEY_MAX bytes.
+ */
+#define MAX_ENTRIES 4096
+#define RESOLVE_KEY_MAX 64
+#define OTHER_KEY "(other)"
+
+typedef struct trace_entry {
+  char *key;
+  unsigned long hash;
+  mcfg_trace_kind kind;
+  unsigned long calls;
+  unsigned long samples;
+  unsigned long total_ns;
+  unsigned long histogram[HISTOGRAM_BUCKETS];
+  int max_depth;
+} trace_entry;
+
+/* Every thread records into its own table without locking and merges it into
+ * the shared table under tables_lock, see flush_table. reset_epoch and
+ * flush_seen are the values of reset_epoch and flush_requests the table has
+ * last seen.
+ */
+typedef struct trace_table {
+  int capacity;
+  int count;
+  trace_entry *entries;
+  unsigned long pending;
+  unsigned long reset_epoch;
+  unsigned long flush_seen;
+  struct trace_table *next;
+} trace_table;
+
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_table *tables = NULL;
+static trace_table shared = {0};
+static unsigned long tables_epoch = 0;
+static unsigned long reset_epoch = 0;
+static unsigned long flush_requests = 0;
+static unsigned long sample_weight = 1;
+
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+static _Thread_local trace_table *local_table = NULL;
+static _Thread_local unsigned long local_epoch = 0;
+
+static const char *kind_names[] = {"sector", "section", "field", "resolve"};
+
+// FNV-1a
+static unsigned long hash_key(mcfg_trace_kind kind, const char *key) {
+  unsigned long hash = 14695981039346656037UL ^ kind;
+  for (; *key != 0; key++) {
+    hash ^= (unsigned char)*key;
+    hash *= 1099511628211UL;
+  }
+
+  return hash;
+}
+
+static void init_table(trace_table *table) {
+  table->capacity = 64;
+  table->count = 0;
+  table->entries = mcfg_malloc(NULL, table->capacity * sizeof(trace_entry));
+  memset(table->entries, 0, table->capacity * sizeof(trace_entry));
+  table->pending = 0;
+}
+
+static void clear_table(trace_table *table) {
+  for (int i = 0; i < table->capacity; i++)
+    mcfg_free(NULL, table->entries[i].key);
+  memset(table->entries, 0, table->capacity * sizeof(trace_entry));
+  table->count = 0;
+  table->pending = 0;
+}
+
+static trace_entry *probe(trace_entry *entries, int capacity,
+                          mcfg_trace_kind kind, const char *key,
+                          unsigned long hash) {
+  int mask = capacity - 1;
+  for (int i = hash & mask;; i = (i + 1) & mask) {
+    trace_entry *entry = &entries[i];
+    if (entry->key == NULL ||
+        (entry->hash == hash && entry->kind == kind &&
+         strcmp(entry->key, key) == 0))
+      return entry;
+  }
+}
+
+static void grow_table(trace_table *table) {
+  int capacity = table->capacity * 2;
+  trace_entry *entries = mcfg_malloc(NULL, capacity * sizeof(trace_entry));
+  memset(entries, 0, capacity * sizeof(trace_entry));
+
+  for (int i = 0; i < table->capacity; i++) {
+    trace_entry *entry = &table->entries[i];
+    if (entry->key != NULL)
+      *probe(entries, capacity, entry->kind, entry->key, entry->hash) = *entry;
+  }
+
+  mcfg_free(NULL, table->entries);
+  table->entries = entries;
+  table->capacity = capacity;
+}
+
+/* Returns the entry for the key, adding it if necessary. Once the table holds
+ * MAX_ENTRIES keys, new keys are counted by the OTHER_KEY entry of the kind.
+ */
+static trace_entry *get_entry(trace_table *table, mcfg_trace_kind kind,
+                              const char *key, unsigned long hash) {
+  if (table->count * 2 >= table->capacity)
+    grow_table(table);
+
+  trace_entry *entry = probe(table->entries, table->capacity, kind, key, hash);
+  if (entry->key != NULL)
+    return entry;
+
+  if (table->count >= MAX_ENTRIES && strcmp(key, OTHER_KEY) != 0)
+    return get_entry(table, kind, OTHER_KEY, hash_key(kind, OTHER_KEY));
+
+  int len = strlen(key);
+  entry->key = mcfg_malloc(NULL, len + 1);
+  memcpy(entry->key, key, len + 1);
+  entry->hash = hash;
+  entry->kind = kind;
+  table->count++;
+
+  return entry;
+}
+
+static void merge_entry(trace_entry *into, trace_entry *from) {
+  into->calls += from->calls;
+  into->samples += from->samples;
+  into->total_ns += from->total_ns;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    into->histogram[i] += from->histogram[i];
+  if (from->max_depth > into->max_depth)
+    into->max_depth = from->max_depth;
+}
+
+/* Merges the table of the calling thread into the shared table and clears
+ * it. Samples recorded before the last reset are dropped.
+ */
+static void flush_table(trace_table *table) {
+  pthread_mutex_lock(&tables_lock);
+  if (table->reset_epoch == reset_epoch) {
+    if (shared.entries == NULL)
+      init_table(&shared);
+
+    for (int i = 0; i < table->capacity; i++) {
+      trace_entry *entry = &table->entries[i];
+      if (entry->key != NULL)
+        merge_entry(get_entry(&shared, entry->kind, entry->key, entry->hash),
+                    entry);
+    }
+  }
+
+  table->reset_epoch = reset_epoch;
+  table->flush_seen = __atomic_load_n(&flush_requests, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&tables_lock);
+
+  clear_table(table);
+}
+
+/* Flushes and releases the table of an exiting thread, unless the collector
+ * was freed in the meantime.
+ */
+static void flush_on_exit(void *table) {
+  if (local_epoch != __atomic_load_n(&tables_epoch, __ATOMIC_ACQUIRE))
+    return;
+
+  flush_table(table);
+
+  pthread_mutex_lock(&tables_lock);
+  trace_table **link = &tables;
+  while (*link != table)
+    link = &(*link)->next;
+  *link = ((trace_table *)table)->next;
+  pthread_mutex_unlock(&tables_lock);
+
+  mcfg_free(NULL, ((trace_table *)table)->entries);
+  mcfg_free(NULL, table);
+  local_table = NULL;
+}
+
+static void create_exit_key(void) {
+  pthread_key_create(&exit_key, flush_on_exit);
+}
+
+static trace_table *get_local_table(void) {
+  unsigned long epoch = __atomic_load_n(&tables_epoch, __ATOMIC_ACQUIRE);
+  if (local_table != NULL && local_epoch == epoch)
+    return local_table;
+
+  trace_table *table = mcfg_malloc(NULL, sizeof(trace_table));
+  init_table(table);
+
+  pthread_mutex_lock(&tables_lock);
+  table->reset_epoch = reset_epoch;
+  table->flush_seen = flush_requests;
+  table->next = tables;
+  tables = table;
+  pthread_mutex_unlock(&tables_lock);
+
+  local_table = table;
+  local_epoch = epoch;
+
+  pthread_once(&exit_key_once, create_exit_key);
+  pthread_setspecific(exit_key, table);
+
+  return table;
+}
+
+static int histogram_bucket(unsigned long ns) {
+  int bucket = 0;
+  ns >>= HISTOGRAM_SHIFT + 1;
+  while (ns > 0 && bucket < HISTOGRAM_BUCKETS - 1) {
+    ns >>= 1;
+    bucket++;
+  }
+
+  return bucket;
+}
+
+static void record_lookup(void *user, mcfg_trace_kind kind, char *path,
+                          unsigned long ns, int depth) {
+  trace_table *table = get_local_table();
+  if (table->reset_epoch != __atomic_load_n(&reset_epoch, __ATOMIC_RELAXED)) {
+    clear_table(table);
+    table->reset_epoch = __atomic_load_n(&reset_epoch, __ATOMIC_RELAXED);
+  }
+
+  // Inputs of resolve_fields are arbitrary strings, so they are cut off
+  char key[RESOLVE_KEY_MAX + 4];
+  if (kind == TK_RESOLVE && strlen(path) > RESOLVE_KEY_MAX) {
+    memcpy(key, path, RESOLVE_KEY_MAX);
+    strcpy(key + RESOLVE_KEY_MAX, "...");
+    path = key;
+  }
+
+  trace_entry *entry = get_entry(table, kind, path, hash_key(kind, path));
+  entry->calls += sample_weight;
+  entry->samples++;
+  entry->total_ns += ns;
+  entry->histogram[histogram_bucket(ns)]++;
+  if (depth > entry->max_depth)
+    entry->max_depth = depth;
+
+  if (++table->pending >= FLUSH_INTERVAL ||
+      table->flush_seen != __atomic_load_n(&flush_requests, __ATOMIC_RELAXED))
+    flush_table(table);
+}
+
+static mcfg_trace_hooks collector_hooks = {1, record_lookup, NULL};
+
+static int compare_key(const void *a, const void *b) {
+  const trace_entry *x = a;
+  const trace_entry *y = b;
+  if (x->kind != y->kind)
+    return x->kind < y->kind ? -1 : 1;
+
+  return strcmp(x->key, y->key);
+}
+
+static int compare_calls(const void *a, const void *b) {
+  const trace_entry *x = a;
+  const trace_entry *y = b;
+  if (x->calls != y->calls)
+    return x->calls > y->calls ? -1 : 1;
+
+  return compare_key(a, b);
+}
+
+/* Upper bound of the latency below which the given share of samples lies */
+static unsigned long percentile(trace_entry *entry, double share) {
+  unsigned long wanted = entry->samples * share;
+  unsigned long seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += entry->histogram[i];
+    if (seen > wanted || seen == entry->samples)
+      return 1UL << (i + HISTOGRAM_SHIFT + 1);
+  }
+
+  return 1UL << (HISTOGRAM_BUCKETS + HISTOGRAM_SHIFT);
+}
+
+static void format_ns(char *out, size_t size, unsigned long ns) {
+  if (ns < 10000)
+    snprintf(out, size, "%luns", ns);
+  else if (ns < 10000000)
+    snprintf(out, size, "%luus", ns / 1000);
+  else
+    snprintf(out, size, "%lums", ns / 1000000);
+}
+
+/******** mcfg_trace.h ********/
+
+void start_mcfg_trace(unsigned sample_rate) {
+  sample_weight = sample_rate > 1 ? sample_rate : 1;
+  collector_hooks.sample_rate = sample_rate;
+  set_mcfg_trace_hooks(&collector_hooks);
+}
+
+void stop_mcfg_trace(void) { set_mcfg_trace_hooks(NULL); }
+
+void dump_mcfg_trace(FILE *out, int limit) {
+  // Other threads merge their tables on their next lookup
+  __atomic_add_fetch(&flush_requests, 1, __ATOMIC_RELAXED);
+  if (local_table != NULL &&
+      local_epoch == __atomic_load_n(&tables_epoch, __ATOMIC_ACQUIRE))
+    flush_table(local_table);
+
+  pthread_mutex_lock(&tables_lock);
+
+  int count = 0;
+  trace_entry *merged =
+      mcfg_malloc(NULL, (shared.count + 1) * sizeof(trace_entry));
+  for (int i = 0; i < shared.capacity; i++)
+    if (shared.entries[i].key != NULL)
+      merged[count++] = shared.entries[i];
+  qsort(merged, count, sizeof(trace_entry), compare_calls);
+
+  fprintf(out, "%-8s %12s %8s %8s %8s %6s  %s\n", "kind", "calls", "mean",
+          "p50", "p99", "depth", "path");
+  for (int i = 0; i < count && i < limit; i++) {
+    trace_entry *entry = &merged[i];
+    char mean[32], p50[32], p99[32];
+    format_ns(mean, sizeof(mean), entry->total_ns / entry->samples);
+    format_ns(p50, sizeof(p50), percentile(entry, 0.5));
+    format_ns(p99, sizeof(p99), percentile(entry, 0.99));
+
+    fprintf(out, "%-8s %12lu %8s %8s %8s ", kind_names[entry->kind],
+            entry->calls, mean, p50, p99);
+    if (entry->kind == TK_RESOLVE)
+      fprintf(out, "%6d  %s\n", entry->max_depth, entry->key);
+    else
+      fprintf(out, "%6s  %s\n", "-", entry->key);
+  }
+
+  mcfg_free(NULL, merged);
+  pthread_mutex_unlock(&tables_lock);
+}
+
+void reset_mcfg_trace(void) {
+  pthread_mutex_lock(&tables_lock);
+  if (shared.entries != NULL)
+    clear_table(&shared);
+
+  // Threads drop what they recorded so far on their next lookup
+  __atomic_add_fetch(&reset_epoch, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&tables_lock);
+}
+
+void free_mcfg_trace(void) {
+  stop_mcfg_trace();
+
+  pthread_mutex_lock(&tables_lock);
+  while (tables != NULL) {
+    trace_table *next = tables->next;
+    clear_table(tables);
+    mcfg_free(NULL, tables->entries);
+    mcfg_free(NULL, tables);
+    tables = next;
+  }
+
+  if (shared.entries != NULL)
+    clear_table(&shared);
+  mcfg_free(NULL, shared.entries);
+  shared = (trace_table){0};
+
+  // Threads notice the new epoch and set up a new table on their next lookup
+  __atomic_add_fetch(&tables_epoch, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&tables_lock);
+}
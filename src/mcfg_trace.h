@@ -0,0 +1,56 @@
+/*
+ * mcfg_trace.h ; author: Marie Eckert
+ *
+ * Collection of lookup statistics through the mcfg trace hooks.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#ifndef MCFG_TRACE_H
+#define MCFG_TRACE_H
+
+#include <stdio.h>
+
+#include <mcfg.h>
+
+/* Starts collecting per path call counts, latency histograms and the
+ * recursion depth of resolve_fields. Every thread counts into its own table
+ * without locking and merges it into a shared table every 1024 samples, when
+ * dump_mcfg_trace asks for it and when the thread exits.
+ *
+ * Inputs of resolve_fields are keyed by their first 64 bytes. At most 4096
+ * distinct keys are tracked, lookups of further keys are counted as "(other)".
+ *
+ * Parameters:
+ *   sample_rate: Only every sample_rate-th lookup per thread is recorded, the
+ *                counts are scaled up accordingly. 0 or 1 records everything.
+ */
+void start_mcfg_trace(unsigned sample_rate);
+
+/* Stops collecting, the collected statistics are kept. */
+void stop_mcfg_trace(void);
+
+/* Prints the limit hottest paths of all threads ordered by their call count,
+ * together with their mean latency, latency percentiles and the deepest
+ * recursion of resolve_fields.
+ *
+ * Notes:
+ *   - The samples of the calling thread are always included, other threads
+ *     which are still running merge theirs on their next lookup, so their
+ *     latest samples only show up in a later dump.
+ */
+void dump_mcfg_trace(FILE *out, int limit);
+
+/* Clears the collected statistics. */
+void reset_mcfg_trace(void);
+
+/* Stops collecting and releases all memory of the collector.
+ *
+ * Notes:
+ *   - No lookups may run on other threads while this is called.
+ */
+void free_mcfg_trace(void);
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * mcfg_writer.c ; author: Marie Eckert
+ *
+ * Serialization of mcfg files back to text.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#include <mcfg_writer.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/******** file private ********/
+
+#define BUFFER_SIZE (256 * 1024)
+
+/* Slices at least this long are not copied into the buffer */
+#define DIRECT_SIZE (16 * 1024)
+
+typedef struct writer {
+  int fd;
+  int result;
+  size_t len;
+  char buffer[BUFFER_SIZE];
+} writer;
+
+static int write_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, iov, count);
+    if (written < 0 && errno == EINTR)
+      continue;
+
+    if (written < 0)
+      return MCFG_ERR_MASK_ERRNO | errno;
+
+    while (count > 0 && (size_t)written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov++;
+      count--;
+    }
+
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  return MCFG_OK;
+}
+
+static void flush(writer *w) {
+  if (w->result != MCFG_OK || w->len == 0)
+    return;
+
+  struct iovec iov = {w->buffer, w->len};
+  w->result = write_all(w->fd, &iov, 1);
+  w->len = 0;
+}
+
+static void put(writer *w, const char *str, size_t len) {
+  if (w->result != MCFG_OK)
+    return;
+
+  if (w->len + len <= BUFFER_SIZE) {
+    memcpy(w->buffer + w->len, str, len);
+    w->len += len;
+    return;
+  }
+
+  if (len >= DIRECT_SIZE) {
+    struct iovec iov[2] = {{w->buffer, w->len}, {(char *)str, len}};
+    w->result = write_all(w->fd, iov, 2);
+    w->len = 0;
+    return;
+  }
+
+  flush(w);
+  memcpy(w->buffer, str, len);
+  w->len = len;
+}
+
+static void put_str(writer *w, const char *str) { put(w, str, strlen(str)); }
+
+static int is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+         c == '\r';
+}
+
+static int valid_name(char *name) {
+  if (name == NULL || name[0] == 0)
+    return 0;
+
+  for (; *name != 0; name++)
+    if (is_space(*name))
+      return 0;
+
+  return 1;
+}
+
+static int is_keyword(char *line, size_t len, const char *word) {
+  size_t word_len = strlen(word);
+  return len >= word_len && memcmp(line, word, word_len) == 0 &&
+         (len == word_len || is_space(line[word_len]));
+}
+
+/* Checks whether the line is read back as a plain line of a lines section */
+static int valid_line(char *line, size_t len) {
+  if (len == 0 || is_space(line[0]) || is_space(line[len - 1]) ||
+      line[0] == ';')
+    return 0;
+
+  return !is_keyword(line, len, "sector") && !is_keyword(line, len, "fields") &&
+         !is_keyword(line, len, "lines");
+}
+
+static int valid_lines(mcfg_section *section) {
+  char *line = section->lines;
+  char *end = section->lines + section->lines_len;
+
+  while (line < end) {
+    char *newline = memchr(line, '\n', end - line);
+    size_t len = (newline == NULL ? end : newline) - line;
+    if (!valid_line(line, len))
+      return 0;
+
+    line += len + 1;
+  }
+
+  return 1;
+}
+
+static int compare_sectors(const void *a, const void *b) {
+  return strcmp((*(mcfg_sector **)a)->name, (*(mcfg_sector **)b)->name);
+}
+
+static int compare_sections(const void *a, const void *b) {
+  return strcmp((*(mcfg_section **)a)->name, (*(mcfg_section **)b)->name);
+}
+
+static int compare_fields(const void *a, const void *b) {
+  return strcmp((*(mcfg_field **)a)->name, (*(mcfg_field **)b)->name);
+}
+
+/* Returns pointers to the count elements of the given size in order, sorted
+ * by compare if canonical is set.
+ */
+static void **ordered(void *elems, int count, size_t size, int canonical,
+                      int (*compare)(const void *, const void *)) {
+  void **result = mcfg_malloc(NULL, (count + 1) * sizeof(void *));
+  for (int i = 0; i < count; i++)
+    result[i] = (char *)elems + i * size;
+
+  if (canonical)
+    qsort(result, count, sizeof(void *), compare);
+
+  return result;
+}
+
+static int write_field(writer *w, mcfg_field *field) {
+  if (!valid_name(field->name) || field->value == NULL ||
+      strchr(field->value, '\n') != NULL)
+    return MCFG_ERR_UNREPRESENTABLE;
+
+  switch (field->type) {
+  case FT_STRING:
+    put(w, "    str ", 8);
+    break;
+  case FT_LIST:
+    put(w, "    list ", 9);
+    break;
+  default:
+    return MCFG_ERR_UNREPRESENTABLE;
+  }
+
+  put_str(w, field->name);
+  put(w, " '", 2);
+  put_str(w, field->value);
+  put(w, "'\n", 2);
+
+  return MCFG_OK;
+}
+
+static int write_section(writer *w, mcfg_section *section, int canonical) {
+  if (!valid_name(section->name))
+    return MCFG_ERR_UNREPRESENTABLE;
+
+  if (section->type == ST_LINES) {
+    if (section->lines != NULL && !valid_lines(section))
+      return MCFG_ERR_UNREPRESENTABLE;
+
+    put(w, "\n  lines ", 9);
+    put_str(w, section->name);
+    put(w, ":\n", 2);
+    if (section->lines != NULL)
+      put(w, section->lines, section->lines_len);
+
+    return MCFG_OK;
+  }
+
+  if (section->type != ST_FIELDS)
+    return MCFG_ERR_UNREPRESENTABLE;
+
+  put(w, "\n  fields ", 10);
+  put_str(w, section->name);
+  put(w, ":\n", 2);
+
+  mcfg_field **fields =
+      (mcfg_field **)ordered(section->fields, section->field_count,
+                             sizeof(mcfg_field), canonical, compare_fields);
+
+  int result = MCFG_OK;
+  for (int i = 0; result == MCFG_OK && i < section->field_count; i++)
+    result = write_field(w, fields[i]);
+
+  mcfg_free(NULL, fields);
+
+  return result;
+}
+
+static int write_sector(writer *w, mcfg_sector *sector, int canonical) {
+  if (!valid_name(sector->name))
+    return MCFG_ERR_UNREPRESENTABLE;
+
+  put(w, "sector ", 7);
+  put_str(w, sector->name);
+  put(w, "\n", 1);
+
+  mcfg_section **sections = (mcfg_section **)ordered(
+      sector->sections, sector->section_count, sizeof(mcfg_section),
+      canonical, compare_sections);
+
+  int result = MCFG_OK;
+  for (int i = 0; result == MCFG_OK && i < sector->section_count; i++)
+    result = write_section(w, sections[i], canonical);
+
+  mcfg_free(NULL, sections);
+
+  return result;
+}
+
+/******** mcfg_writer.h ********/
+
+int write_mcfg_file(mcfg_file *file, int fd, int flags) {
+  int canonical = flags & MCFG_WRITE_CANONICAL;
+  writer *w = mcfg_malloc(NULL, sizeof(writer));
+  w->fd = fd;
+  w->result = MCFG_OK;
+  w->len = 0;
+
+  int result = MCFG_OK;
+  for (int i = 0; result == MCFG_OK && i < file->import_count; i++) {
+    // The path is written as it was given in the import directive, as the
+    // path of the imported file is already joined with the importer's
+    // directory
+    char *path = file->import_paths != NULL ? file->import_paths[i]
+                                            : file->imports[i]->path;
+    if (path == NULL || strpbrk(path, "'\n") != NULL) {
+      result = MCFG_ERR_UNREPRESENTABLE;
+      break;
+    }
+
+    put(w, "import '", 8);
+    put_str(w, path);
+    put(w, "'\n", 2);
+  }
+
+  mcfg_sector **sectors =
+      (mcfg_sector **)ordered(file->sectors, file->sector_count,
+                              sizeof(mcfg_sector), canonical, compare_sectors);
+
+  for (int i = 0; result == MCFG_OK && i < file->sector_count; i++) {
+    if (i > 0 || file->import_count > 0)
+      put(w, "\n", 1);
+    result = write_sector(w, sectors[i], canonical);
+  }
+
+  mcfg_free(NULL, sectors);
+
+  flush(w);
+  if (result == MCFG_OK)
+    result = w->result;
+
+  mcfg_free(NULL, w);
+
+  return result;
+}
+
+int save_mcfg_file(mcfg_file *file, char *path, int flags) {
+  // Written to a temporary file first, so a failed write does not destroy an
+  // existing file
+  size_t len = strlen(path);
+  char *tmp_path = mcfg_malloc(NULL, len + 5);
+  memcpy(tmp_path, path, len);
+  memcpy(tmp_path + len, ".tmp", 5);
+
+  int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    int result = MCFG_ERR_MASK_ERRNO | errno;
+    mcfg_free(NULL, tmp_path);
+    return result;
+  }
+
+  int result = write_mcfg_file(file, fd, flags);
+  if (close(fd) != 0 && result == MCFG_OK)
+    result = MCFG_ERR_MASK_ERRNO | errno;
+
+  if (result == MCFG_OK && rename(tmp_path, path) != 0)
+    result = MCFG_ERR_MASK_ERRNO | errno;
+
+  if (result != MCFG_OK)
+    unlink(tmp_path);
+
+  mcfg_free(NULL, tmp_path);
+
+  return result;
+}
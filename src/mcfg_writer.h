@@ -0,0 +1,49 @@
+/*
+ * mcfg_writer.h ; author: Marie Eckert
+ *
+ * Serialization of mcfg files back to text.
+ *
+ * Copyright (c) 2023, Marie Eckert
+ * Licensed under the BSD 3-Clause License
+ * <https://github.com/FelixEcker/mcfg/blob/master/LICENSE>
+ */
+
+#ifndef MCFG_WRITER_H
+#define MCFG_WRITER_H
+
+#include <mcfg.h>
+
+/* Sort sectors, sections and fields by name instead of keeping their order */
+#define MCFG_WRITE_CANONICAL 0x00000001
+
+/* Writes the file as mcfg text to the given file descriptor.
+ *
+ * Small pieces are collected in a large buffer, long values and the content
+ * of lines sections are passed to writev directly without being copied.
+ * Parsing the output with parse_file yields the same sectors, sections,
+ * fields and lines.
+ *
+ * Returns:
+ *   MCFG_OK if everything was written, MCFG_ERR_UNREPRESENTABLE if the file
+ *   contains something which can not be expressed in mcfg text or an errno
+ *   code if writing failed.
+ *
+ * Notes:
+ *   - Names must not be empty or contain whitespace and values must not
+ *     contain newlines.
+ *   - Lines of lines sections must not be empty, start with a comment or a
+ *     sector or section header, or have leading or trailing whitespace.
+ *   - Imports are written as import directives with the path given in the
+ *     original directive, their contents are not written. Relative paths are
+ *     resolved against the directory of the written file when it is parsed
+ *     again, so they only refer to the same fragment if it is written next
+ *     to the original file.
+ *   - Something may have been written already when an error is returned.
+ */
+int write_mcfg_file(mcfg_file *file, int fd, int flags);
+
+/* Writes the file to the given path, replacing an existing file.
+ */
+int save_mcfg_file(mcfg_file *file, char *path, int flags);
+
+#endif
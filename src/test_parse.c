@@ -4,8 +4,13 @@
  */
 
 #include <mcfg.h>
+#include <mcfg_batch.h>
+#include <mcfg_index.h>
+#include <mcfg_registry.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
 
 void print_structure(struct mcfg_file *file) {
   printf("\n==========================\n\n");
@@ -28,6 +33,246 @@ void print_structure(struct mcfg_file *file) {
   printf("\n==========================\n");
 }
 
+/* Counts every allocation made through the global allocator, parsing into a
+ * storage must not make any.
+ */
+static int allocation_count = 0;
+
+static void *counting_malloc(void *ctx, size_t size) {
+  allocation_count++;
+  return malloc(size);
+}
+
+static void *counting_realloc(void *ctx, void *ptr, size_t size) {
+  allocation_count++;
+  return realloc(ptr, size);
+}
+
+static void counting_free(void *ctx, void *ptr) { free(ptr); }
+
+static mcfg_allocator counting_allocator = {counting_malloc, counting_realloc,
+                                            counting_free, NULL};
+
+static mcfg_storage storage;
+
+int test_static_parse(void) {
+  mcfg_file file = {.path = "./bugtest.mb"};
+
+  set_mcfg_allocator(&counting_allocator);
+  int result = parse_file_static(&file, &storage);
+  set_mcfg_allocator(NULL);
+
+  if (result != MCFG_OK) {
+    printf("Static parsing failed: 0x%.8x\n", result);
+    return result;
+  }
+
+  if (allocation_count != 0) {
+    printf("Static parsing allocated %d times\n", allocation_count);
+    return MCFG_ERR_UNKNOWN;
+  }
+
+  printf("Static parsing: %d sectors, %d sections, %d fields\n",
+         storage.sector_count, storage.section_count, storage.field_count);
+
+  return MCFG_OK;
+}
+
+/* A handle to a field added within a transaction must not survive rolling
+ * the transaction back, even once another field takes over its position.
+ */
+int test_transaction_rollback(void) {
+  mcfg_file *file = calloc(1, sizeof(mcfg_file));
+  mcfg_transaction txn;
+  mcfg_handle handle;
+  int result = MCFG_OK;
+
+  set_field(file, "sector/section/kept", FT_STRING, "1");
+  begin_mcfg_transaction(&txn, file, NULL, NULL);
+  txn_set_field(&txn, "sector/section/added", FT_STRING, "2");
+  get_mcfg_handle(file, "sector/section/added", &handle);
+  rollback_mcfg_transaction(&txn);
+  set_field(file, "sector/section/other", FT_STRING, "3");
+
+  if (handle_field(handle) != NULL) {
+    printf("Handle survived rolling back its field\n");
+    result = MCFG_ERR_UNKNOWN;
+  } else {
+    printf("Transaction rollback: ok\n");
+  }
+
+  free_mcfg_file(file);
+
+  return result;
+}
+
+/* Removing a field outside of a transaction must not leave an index over the
+ * file pointing to moved or freed records.
+ */
+int test_index_after_mutation(void) {
+  mcfg_file *file = calloc(1, sizeof(mcfg_file));
+  mcfg_index index;
+  mcfg_query query;
+  int result = MCFG_OK;
+
+  set_field(file, "sector/section/a", FT_STRING, "1");
+  set_field(file, "sector/section/b", FT_STRING, "2");
+  build_mcfg_index(&index, file);
+
+  remove_field(file, "sector/section/a");
+  set_field(file, "sector/other/c", FT_STRING, "3");
+
+  int count = 0;
+  start_query(&query, &index, "sector/*/*");
+  while (next_query_result(&query) != NULL)
+    count++;
+
+  if (count != 2 || index.field_count != 2) {
+    printf("Stale index returned %d fields\n", count);
+    result = MCFG_ERR_UNKNOWN;
+  } else {
+    printf("Index after mutation: ok\n");
+  }
+
+  free_mcfg_index(&index);
+  free_mcfg_file(file);
+
+  return result;
+}
+
+/* A query narrowed to a literal sector has to find the same fields as a scan
+ * over all sectors.
+ */
+int test_query_by_sector(void) {
+  mcfg_file *file = calloc(1, sizeof(mcfg_file));
+  mcfg_index index;
+  mcfg_query query;
+  int result = MCFG_OK;
+  char path[64];
+
+  for (int i = 0; i < 8; i++)
+    for (int j = 0; j < 4; j++) {
+      snprintf(path, sizeof(path), "sector%d/section%d/field%d", i, j, i + j);
+      set_field(file, path, FT_STRING, "x");
+    }
+  build_mcfg_index(&index, file);
+
+  char *patterns[] = {"sector3/*/*", "sector3/sec*/field4", "sector3*/*/*",
+                      "sector9/*/*", "sector3/section*/field*"};
+  int expected[] = {4, 1, 4, 0, 4};
+  for (int i = 0; i < 5; i++) {
+    int count = 0;
+    start_query(&query, &index, patterns[i]);
+    while (next_query_result(&query) != NULL)
+      count++;
+
+    if (count != expected[i]) {
+      printf("Query %s found %d fields\n", patterns[i], count);
+      result = MCFG_ERR_UNKNOWN;
+    }
+  }
+
+  if (result == MCFG_OK)
+    printf("Query by sector: ok\n");
+
+  free_mcfg_index(&index);
+  free_mcfg_file(file);
+
+  return result;
+}
+
+/* A list referenced through the registry has to be formatted the same way as
+ * a local reference to it.
+ */
+int test_registry_list(void) {
+  mcfg_file *file = calloc(1, sizeof(mcfg_file));
+  mcfg_registry registry;
+  int result = MCFG_OK;
+
+  set_field(file, "sector/section/dirs", FT_LIST, "a:b:c");
+  set_field(file, "sector/section/mode", FT_STRING, "debug");
+  init_mcfg_registry(&registry);
+  add_mcfg_registry_file(&registry, "other", file);
+
+  char *local = resolve_fields(*file, "cc -I$(dirs)/include -o $(mode)",
+                               "sector/section/", 0);
+  char *cross = resolve_registry_fields(
+      &registry, NULL,
+      "cc -I$(other:sector/section/dirs)/include -o "
+      "$(other:sector/section/mode)",
+      NULL, 0);
+  char *raw = resolve_registry_fields(
+      &registry, NULL, "$(other:sector/section/dirs)", NULL, 1);
+
+  if (strcmp(local, cross) != 0 || strcmp(raw, "a:b:c") != 0) {
+    printf("Registry list: '%s' instead of '%s', raw '%s'\n", cross, local,
+           raw);
+    result = MCFG_ERR_UNKNOWN;
+  } else {
+    printf("Registry list: ok\n");
+  }
+
+  mcfg_free(file->allocator, local);
+  mcfg_free(NULL, cross);
+  mcfg_free(NULL, raw);
+  free_mcfg_registry(&registry);
+  free_mcfg_file(file);
+
+  return result;
+}
+
+/* Writes a gzip compressed copy of a file */
+static int gzip_copy(char *from, char *to) {
+  FILE *in = fopen(from, "r");
+  gzFile out = gzopen(to, "wb");
+  if (in == NULL || out == NULL) {
+    if (in != NULL)
+      fclose(in);
+    if (out != NULL)
+      gzclose(out);
+    return MCFG_ERR_UNKNOWN;
+  }
+
+  char buffer[4096];
+  size_t len;
+  while ((len = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    gzwrite(out, buffer, len);
+
+  fclose(in);
+  gzclose(out);
+  return MCFG_OK;
+}
+
+/* A compressed file has to load the same through io_uring and through the
+ * thread pool.
+ */
+int test_batch_gzip(void) {
+  char *paths[] = {"./bugtest.mb.gz"};
+  int flags[] = {0, MCFG_BATCH_NO_URING};
+  mcfg_batch batch;
+  int result = gzip_copy("./bugtest.mb", paths[0]);
+
+  for (int i = 0; i < 2 && result == MCFG_OK; i++) {
+    result = load_mcfg_batch(&batch, paths, 1, 1, flags[i]);
+    if (result != MCFG_OK)
+      break;
+
+    if (batch.results[0] != MCFG_OK ||
+        find_field(batch.files[0], ".config/mariebuild/finalize_cmd") == NULL) {
+      printf("Batch load of a gzip file failed: 0x%.8x\n", batch.results[0]);
+      result = MCFG_ERR_UNKNOWN;
+    }
+
+    free_mcfg_batch(&batch);
+  }
+
+  remove(paths[0]);
+  if (result == MCFG_OK)
+    printf("Batch gzip: ok\n");
+
+  return result;
+}
+
 int main() {
   struct mcfg_file *file = malloc(sizeof(mcfg_file));
   file->path = "./bugtest.mb";
@@ -37,7 +282,7 @@ int main() {
     result = result ^ 0;
 
   if (result != 0) {
-    printf("Parsing failed: Line %d\n", file->line);
+    printf("Parsing failed: Line %d, Column %d\n", file->line, file->column);
     printf("Parsing failed: 0x%.8x\n", result);
   } else {
     print_structure(file);
@@ -45,10 +290,28 @@ int main() {
         (*file), find_field(file, ".config/mariebuild/finalize_cmd")->value,
         ".config/mariebuild/", 0);
     printf("%s\n", resolved);
-    free(resolved);
+    mcfg_free(file->allocator, resolved);
   }
 
   free_mcfg_file(file);
 
+  if (result == 0)
+    result = test_static_parse();
+
+  if (result == 0)
+    result = test_transaction_rollback();
+
+  if (result == 0)
+    result = test_index_after_mutation();
+
+  if (result == 0)
+    result = test_query_by_sector();
+
+  if (result == 0)
+    result = test_registry_list();
+
+  if (result == 0)
+    result = test_batch_gzip();
+
   return result;
 }